@@ -0,0 +1,342 @@
+/* Benchmark harness for the image pipeline in process.c.
+ *
+ * Compile:
+ *   gcc -O2 -pthread -o bench bench.c -lm
+ * Run:
+ *   ./bench [OPTIONS]
+ *   ./bench --generate=WIDTHxHEIGHT FILE    (write one synthetic HS16 image and exit)
+ *
+ * For every requested size a deterministic synthetic HS16 file is generated,
+ * then load_image, image_histogram, copy_image, apply_MONO, apply_MONO_in_place
+ * (on the copy), apply_CODE and save_image are timed separately. Each stage is run --repeat
+ * times and the fastest run reported, as throughput over the image's pixel
+ * payload (width * height * 6 bytes).
+ * CODE output goes to /dev/null; results go to the original stdout. */
+
+#define PROCESS_NO_MAIN
+#include "process.c"
+
+#define BENCH_SEED 0x5eed1234u      // Seed of the synthetic images, mixed with their dimensions
+#define BENCH_SIZES "thumb,vga,hd,16mp"
+
+/* A named benchmark size */
+struct Size {
+    const char *name;
+    int width;
+    int height;
+};
+
+const struct Size presets[] = {
+    {"thumb", 160, 120},
+    {"vga", 640, 480},
+    {"hd", 1920, 1080},
+    {"16mp", 4608, 3456},
+    {"100mp", 12288, 8192},
+    {"500mp", 25820, 19365},
+};
+
+/* Timings of one image size, fastest run of each stage in seconds */
+struct Result {
+    struct Size size;
+    bool mapped;        // Whether load_image used the file's payload in place
+    double load, stats, copy, mono, inplace, code, save;
+};
+
+/* Next value of a xorshift32 sequence */
+static inline uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Write a width x height HS16 file at path whose content only depends on the
+ * dimensions and seed: per-channel gradients with low-order noise, so images
+ * look like smooth scans rather than pure noise. Returns false on error. */
+bool generate_hs16(const char *path, int width, int height, uint32_t seed)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+
+    struct Pixel *row = malloc((size_t)width * sizeof *row);
+    bool ok = row != NULL && fprintf(f, "%s\t%i\t%i ", IMG_FORMAT, width, height) > 0;
+
+    uint32_t state = seed ^ ((uint32_t)width * 2654435761u) ^ ((uint32_t)height * 40503u);
+    if (state == 0)
+        state = BENCH_SEED;
+
+    for (int i = 0; ok && i < height; i++) {
+        uint32_t y = (uint32_t)((uint64_t)i * 65535 / height);
+        for (int j = 0; j < width; j++) {
+            uint32_t x = (uint32_t)((uint64_t)j * 65535 / width);
+            uint32_t noise = xorshift32(&state);
+            row[j].red = (uint16_t)((x + (noise & 0x3ff)) & 0xffff);
+            row[j].green = (uint16_t)((y + ((noise >> 10) & 0x3ff)) & 0xffff);
+            row[j].blue = (uint16_t)(((x + y) / 2 + ((noise >> 20) & 0x3ff)) & 0xffff);
+        }
+        ok = fwrite(row, sizeof *row, width, f) == (size_t)width;
+    }
+
+    free(row);
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+/* Parse a preset name or WIDTHxHEIGHT into *size. Returns false if it is neither. */
+bool parse_size(const char *text, struct Size *size)
+{
+    for (size_t k = 0; k < sizeof(presets) / sizeof(presets[0]); k++)
+        if (strcmp(text, presets[k].name) == 0) {
+            *size = presets[k];
+            return true;
+        }
+
+    int w, h;
+    char end;
+    if (sscanf(text, "%dx%d%c", &w, &h, &end) != 2 || w <= 0 || h <= 0)
+        return false;
+    size->name = text;
+    size->width = w;
+    size->height = h;
+    return true;
+}
+
+/* Keep the faster of *best and elapsed */
+static inline void keep_best(double *best, double elapsed)
+{
+    if (*best == 0 || elapsed < *best)
+        *best = elapsed;
+}
+
+/* Generate the image for r->size in dir and time each stage repeat times.
+ * Returns false on error, after printing a message. */
+bool bench_size(struct Result *r, const char *dir, int repeat, bool keep)
+{
+    char input[MAX_FILENAME + 1], output[MAX_FILENAME + 1];
+    snprintf(input, sizeof(input), "%s/bench-%dx%d.hs16", dir, r->size.width, r->size.height);
+    snprintf(output, sizeof(output), "%s/bench-%dx%d-out.hs16", dir, r->size.width, r->size.height);
+
+    if (!generate_hs16(input, r->size.width, r->size.height, BENCH_SEED)) {
+        fprintf(stderr, "Unable to generate %s.\n", input);
+        return false;
+    }
+
+    bool ok = true;
+    for (int run = 0; ok && run < repeat; run++) {
+        double t = now();
+        struct Image *img = load_image(input);
+        if (img == NULL) {
+            ok = false;
+            break;
+        }
+        keep_best(&r->load, now() - t);
+        r->mapped = img->storage == STORAGE_MAPPED;
+
+        struct Histogram *hist = calloc(1, sizeof *hist);
+        if (hist == NULL) {
+            fprintf(stderr, "Out of memory benchmarking %dx%d.\n", r->size.width, r->size.height);
+            free_image(img);
+            ok = false;
+            break;
+        }
+        t = now();
+        image_histogram(img, hist);
+        keep_best(&r->stats, now() - t);
+        free(hist);
+
+        t = now();
+        struct Image *copy = copy_image(img);
+        keep_best(&r->copy, now() - t);
+
+        t = now();
+        struct Image *mono = apply_MONO(img);
+        keep_best(&r->mono, now() - t);
+
+        if (copy == NULL || mono == NULL) {
+            fprintf(stderr, "Out of memory benchmarking %dx%d.\n", r->size.width, r->size.height);
+            ok = false;
+        } else {
+            t = now();
+            apply_MONO_in_place(copy);
+            keep_best(&r->inplace, now() - t);
+
+            t = now();
+            ok = apply_CODE(mono);
+            fflush(stdout);
+            keep_best(&r->code, now() - t);
+
+            t = now();
+            if (!save_image(mono, output)) {
+                fprintf(stderr, "Saving image to %s failed.\n", output);
+                ok = false;
+            }
+            keep_best(&r->save, now() - t);
+        }
+
+        if (copy != NULL)
+            free_image(copy);
+        if (mono != NULL)
+            free_image(mono);
+        free_image(img);
+    }
+
+    if (!keep) {
+        remove(input);
+        remove(output);
+    }
+    return ok;
+}
+
+/* Print the results of one size as a text table or as JSON lines */
+void report(FILE *out, const struct Result *r, bool json)
+{
+    const char *stages[] = {"load", "stats", "copy", "mono", "inplace", "code", "save"};
+    const double seconds[] = {r->load, r->stats, r->copy, r->mono, r->inplace, r->code, r->save};
+    double pixels = (double)r->size.width * r->size.height;
+    const char *simd_names[] = {"auto", "scalar", "sse2", "avx2"};
+
+    for (int k = 0; k < 7; k++) {
+        double mb_per_s = seconds[k] > 0 ? pixels * sizeof(struct Pixel) / seconds[k] / 1e6 : 0;
+        double mpixels_per_s = seconds[k] > 0 ? pixels / seconds[k] / 1e6 : 0;
+        if (json)
+            fprintf(out, "{\"size\": \"%s\", \"width\": %d, \"height\": %d, \"stage\": \"%s\", "
+                         "\"seconds\": %.6f, \"mb_per_s\": %.1f, \"mpixels_per_s\": %.1f, "
+                         "\"simd\": \"%s\", \"threads\": %d, \"layout\": \"%s\", \"mapped\": %s}\n",
+                    r->size.name, r->size.width, r->size.height, stages[k],
+                    seconds[k], mb_per_s, mpixels_per_s, simd_names[simd], thread_count,
+                    image_layout == LAYOUT_PLANAR ? "planar" : "interleaved", r->mapped ? "true" : "false");
+        else
+            fprintf(out, "%-8s %6dx%-6d %-7s %10.6f s %10.1f MB/s %10.1f Mpixel/s\n",
+                    r->size.name, r->size.width, r->size.height, stages[k], seconds[k], mb_per_s, mpixels_per_s);
+    }
+}
+
+void bench_usage(void)
+{
+    fprintf(stderr, "Usage: bench [OPTIONS]\n");
+    fprintf(stderr, "       bench --generate=WIDTHxHEIGHT FILE\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --sizes=LIST  comma separated presets or WIDTHxHEIGHT (default %s)\n", BENCH_SIZES);
+    fprintf(stderr, "                presets: thumb, vga, hd, 16mp, 100mp, 500mp\n");
+    fprintf(stderr, "  --repeat=N    runs per size, the fastest is reported (default 3)\n");
+    fprintf(stderr, "  --json        print one JSON object per size and stage\n");
+    fprintf(stderr, "  --dir=DIR     directory for generated files (default /tmp)\n");
+    fprintf(stderr, "  --keep        keep the generated files\n");
+    fprintf(stderr, "  --simd, --threads, --planar, --pad-rows, --no-mmap, --writev,\n");
+    fprintf(stderr, "                --no-recycle, --compress, --tile, --input-order as for process\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"sizes", required_argument, NULL, 's'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"json", no_argument, NULL, 'J'},
+        {"dir", required_argument, NULL, 'd'},
+        {"keep", no_argument, NULL, 'k'},
+        {"generate", required_argument, NULL, 'g'},
+        {"simd", required_argument, NULL, 'I'},
+        {"threads", required_argument, NULL, 'j'},
+        {"planar", no_argument, NULL, 'P'},
+        {"pad-rows", no_argument, NULL, 'p'},
+        {"no-mmap", no_argument, NULL, 'M'},
+        {"writev", no_argument, NULL, 'V'},
+        {"no-recycle", no_argument, NULL, 'C'},
+        {"compress", no_argument, NULL, 'z'},
+        {"tile", optional_argument, NULL, 't'},
+        {"input-order", required_argument, NULL, 'E'},
+        {NULL, 0, NULL, 0}
+    };
+
+    char sizes[256] = BENCH_SIZES;
+    const char *dir = "/tmp";
+    const char *generate = NULL;
+    int repeat = 3;
+    bool json = false, keep = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+            case 'r': repeat = atoi(optarg); break;
+            case 'J': json = true; break;
+            case 'd': dir = optarg; break;
+            case 'k': keep = true; break;
+            case 'g': generate = optarg; break;
+            case 'j': thread_count = atoi(optarg); break;
+            case 'P': image_layout = LAYOUT_PLANAR; break;
+            case 'p': pad_rows = true; break;
+            case 'M': map_input = false; break;
+            case 'V': write_mode = WRITE_VECTORED; break;
+            case 'C': recycle_images = false; break;
+            case 'z': compress_output = true; break;
+            case 't':
+                if (!parse_tile(optarg)) { bench_usage(); return 1; }
+                break;
+            case 'E':
+                if (strcmp(optarg, "native") == 0) input_order = ORDER_NATIVE;
+                else if (strcmp(optarg, "little") == 0) input_order = ORDER_LITTLE;
+                else if (strcmp(optarg, "big") == 0) input_order = ORDER_BIG;
+                else { bench_usage(); return 1; }
+                break;
+            case 'I':
+                if (strcmp(optarg, "auto") == 0) simd = SIMD_AUTO;
+                else if (strcmp(optarg, "scalar") == 0) simd = SIMD_SCALAR;
+                else if (strcmp(optarg, "sse2") == 0) simd = SIMD_SSE2;
+                else if (strcmp(optarg, "avx2") == 0) simd = SIMD_AVX2;
+                else { bench_usage(); return 1; }
+                break;
+            default: bench_usage(); return 1;
+        }
+    }
+    if (repeat < 1 || thread_count < 0) {
+        bench_usage();
+        return 1;
+    }
+
+    if (generate != NULL) {
+        struct Size size;
+        if (!parse_size(generate, &size) || optind != argc - 1) {
+            bench_usage();
+            return 1;
+        }
+        if (!generate_hs16(argv[optind], size.width, size.height, BENCH_SEED)) {
+            fprintf(stderr, "Unable to generate %s.\n", argv[optind]);
+            return 1;
+        }
+        return 0;
+    }
+
+    resolve_simd();
+    if (!create_pool()) {
+        fprintf(stderr, "Unable to start %d threads.\n", thread_count);
+        return 1;
+    }
+    atexit(image_pool_drain);
+
+    /* Results keep the original stdout, CODE output is discarded */
+    FILE *results = fdopen(dup(fileno(stdout)), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Unable to redirect standard output.\n");
+        return 1;
+    }
+
+    for (char *token = strtok(sizes, ","); token != NULL; token = strtok(NULL, ",")) {
+        struct Result r = {0};
+        if (!parse_size(token, &r.size)) {
+            fprintf(stderr, "Unknown size %s.\n", token);
+            return 1;
+        }
+        if (!bench_size(&r, dir, repeat, keep))
+            return 1;
+        report(results, &r, json);
+        fflush(results);
+    }
+
+    fclose(results);
+    return 0;
+}
@@ -3,13 +3,85 @@
  * Distributing this coursework specification or your solution to it outside
  * the university is academic misconduct and a violation of copyright law. */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 #define IMG_FORMAT "HS16"
+#define ZIMG_FORMAT "HS1Z"      // Compressed variant of HS16, read transparently and written with --compress
+#define TIMG_FORMAT "HS1T"      // Tiled variant of HS16 with a tile index, read transparently and written with --tile
+#define TILE_SIZE 256           // Default tile width and height of --tile
+#define TILE_INDEX_ENTRY 16     // Bytes per tile in an HS1T index: little-endian 64-bit offset and length
+#define PYRAMID_AUTO -1         // pyramid_levels of a bare --pyramid: halve until the image fits in PYRAMID_MIN
+#define PYRAMID_MIN 256         // Longest side of the smallest level of a bare --pyramid
+#define PYRAMID_MAX 31          // Most pyramid levels; an int dimension is 1 pixel after 31 halvings
 #define MAX_FILENAME 255
+#define PIXEL_ALIGN 64          // Byte alignment of pixel buffers (one cache line, a whole AVX-512 vector)
+#define ROW_ALIGN_PIXELS 32     // Padded rows are a multiple of this many Pixels (192 bytes = 3 cache lines)
+#define BANDS_PER_THREAD 4      // Row bands per thread in parallel_rows, so uneven bands still balance
+#define QUEUE_DEPTH 2           // Images waiting between two --pipeline stages
+#define AIO_DEPTH 64            // Reads and writes kept in flight by a bare --async
+#define AIO_DEPTH_MAX 4096      // Largest --async queue depth
+#define AIO_THREADS_MAX 32      // Most I/O threads of the thread-pool --async backend
+#define AIO_OP_MAX (1 << 30)    // Bytes per request handed to the kernel; longer transfers are resubmitted
+#define CACHE_RUN 64            // Cache misses processed together, each holding its CODE text file open
+#define CACHE_CHUNK (1 << 20)   // Bytes read at a time when hashing or copying files for --cache
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL    // Primes of XXH64, the --cache hash
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+#define IO_CHUNK_PIXELS 65536   // Pixels staged at a time when converting between file and planar layout
+#define CODE_LINE_MAX 69        // Longest line of pixel data apply_CODE prints, indentation included
+#define CODE_ROW_PIXELS 1024    // Pixels of a row reduced to 8 bits at a time by apply_CODE
+#define CODE_BUFFER 65536       // Bytes of C source apply_CODE collects before each fwrite
+#define POOL_IMAGES 8           // Released heap images kept for reuse by new_image
+#define OPS_MAX 16              // Operations in an --ops chain
+#define OPS_CHUNK_PIXELS 2048   // Pixels of a row taken through every step of an --ops chain at a time (12 KiB)
+#define CONV_MAX_RADIUS 64      // Largest --filter kernel radius, in pixels
+#define CONV_SHIFT 14           // Fixed point of convolution weights, which sum to exactly 1 << CONV_SHIFT
+#define CONV_BLOCK_SAMPLES 2048 // Columns of samples filtered at a time by the vertical pass
+#define HIST_BINS 65536         // Histogram bins per channel, one per 16-bit sample value
+#define RICE_LIMIT 24           // Longest unary prefix of a Rice code; longer residuals are escaped as raw 16 bits
+#define RICE_INIT 1024          // Initial mean residual magnitude of each channel of an HS1Z chunk, times RICE_RESET
+#define RICE_RESET 64           // Samples after which the running residual statistics are halved
+#define HEADER_MAX 72           // Longest header save_image writes or read_header accepts: format, up to five ints
+#define MONO_R 19595            // 0.299 in 16-bit fixed point
+#define MONO_G 38470            // 0.587 in 16-bit fixed point
+#define MONO_B 7471             // 0.114 in 16-bit fixed point, the three weights sum to exactly 1 << 16
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024            // Buffers per writev call, when <limits.h> does not say (Linux limit)
+#endif
 
 /* The RGB values of a pixel. */
 struct Pixel {
@@ -18,397 +90,5848 @@ struct Pixel {
     uint16_t blue;
 };
 
-/* An image loaded from a file. */
+/* How save_image hands the header and bitmap to the operating system. */
+enum WriteMode {
+    WRITE_STDIO,        // fwrite of the whole bitmap (or whole rows) through a FILE stream
+    WRITE_VECTORED      // writev of the header and bitmap rows straight from memory, no stdio copy
+};
+
+/* Instruction set used by the vectorised kernels. */
+enum Simd {
+    SIMD_AUTO,          // Best level the CPU supports, resolved once at startup
+    SIMD_SCALAR,        // Portable C reference kernels
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+/* Byte order of the 16-bit samples of HS16 input files (--input-order). */
+enum ByteOrder {
+    ORDER_NATIVE,       // This machine's, as save_image writes them
+    ORDER_LITTLE,
+    ORDER_BIG
+};
+
+/* How the channels of a struct Image are arranged in memory. */
+enum Layout {
+    LAYOUT_INTERLEAVED, // One struct Pixel per pixel, as in the file
+    LAYOUT_PLANAR       // Separate red, green and blue planes of 16-bit samples
+};
+
+/* Persistent worker threads that split a range of image rows into bands.
+ * One job runs at a time: parallel_rows publishes it, workers and the calling
+ * thread claim bands of band_rows rows until none are left. */
+struct ThreadPool {
+    pthread_t *threads;
+    int count;                          // Worker threads; the calling thread works too
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                // Signalled when a job is published or the pool stops
+    pthread_cond_t idle;                // Signalled when the last band of a job finishes
+    pthread_mutex_t submit;             // Serialises callers of parallel_rows
+    void (*fn)(void *ctx, int row0, int row1);
+    void *ctx;
+    int rows;                           // Rows in the current job, 0 when there is none
+    int band_rows;
+    int next_row;                       // First row not yet claimed
+    int active;                         // Bands claimed but not finished
+    bool stop;
+};
+
+/* An image handed from one --pipeline stage to the next. img is NULL when
+ * an earlier stage failed on input index, which stops the pipeline. */
+struct QueueItem {
+    int index;
+    struct Image *img;
+};
+
+/* Bounded FIFO between two --pipeline stages. Pushing blocks while it holds
+ * QUEUE_DEPTH items, popping blocks while it is empty and still open. */
+struct Queue {
+    struct QueueItem items[QUEUE_DEPTH];
+    int head;
+    int count;
+    bool closed;                        // No more pushes; pops drain what is left
+    bool cancelled;                     // A later stage gave up; pushes fail at once
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* Where --async sends its requests */
+enum AioBackend {
+    AIO_AUTO,           // io_uring when the kernel has it, otherwise threads
+    AIO_URING,          // Linux io_uring rings, driven by raw system calls
+    AIO_THREADS         // A pool of threads making blocking pread/pwrite/fsync calls
+};
+
+enum AioOp {
+    AIO_READ,           // Up to len bytes; ends early only at end of file
+    AIO_WRITE,
+    AIO_FSYNC
+};
+
+/* One request of an AsyncIO. On completion, result is the bytes
+ * transferred, 0 for a completed fsync, or a negative errno. */
+struct AioRequest {
+    enum AioOp op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    int tag;                            // The caller's, handed back with the completion
+    ssize_t result;
+};
+
+/* Up to depth requests in flight at once, whatever the backend. Each
+ * occupies a slot until its completion is collected; a transfer the kernel
+ * completes only in part is resubmitted from its slot until it is whole. */
+struct AsyncIO {
+    enum AioBackend backend;            // Never AIO_AUTO once initialised
+    int depth;
+    int inflight;
+    struct AioRequest *slots;
+    size_t *done;                       // Bytes transferred so far by each slot's request
+    int *free_slots;                    // Stack of unused slots
+    int free_count;
+#ifdef HAVE_IO_URING
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;               // Entries queued since the last io_uring_enter
+#endif
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;                // Signalled when a request is queued or the threads stop
+    pthread_cond_t finished;            // Signalled when a request completes
+    int *queued;                        // FIFO of slots waiting for a thread, depth long
+    int queued_head, queued_count;
+    int *completed;                     // FIFO of slots whose completion is not yet collected
+    int completed_head, completed_count;
+    bool stop;
+};
+
+/* C source being printed by apply_CODE. Pixels are appended as they come,
+ * so an image can also be emitted a chunk of rows at a time. Text is
+ * collected in buf and handed to fwrite CODE_BUFFER bytes at a time. */
+struct CodeWriter {
+    FILE *out;
+    FILE *copy;                         // Also receives the text when not NULL (--cache)
+    size_t used;                        // Bytes of buf filled
+    size_t line_len;                    // Length of the current line, counting the ", " owed to its last pixel
+    size_t count;                       // Pixels emitted so far
+    char buf[CODE_BUFFER];
+};
+
+/* Bits appended to a buffer most significant first, as HS1Z chunks are coded */
+struct BitWriter {
+    uint8_t *out;
+    size_t len;                         // Bytes completed
+    uint64_t acc;                       // Pending bits in the low bits bits
+    int bits;
+};
+
+/* Bits read from a buffer most significant first. acc holds the next bits
+ * bits at its top; bytes past len read as zero. */
+struct BitReader {
+    const uint8_t *in;
+    size_t len;
+    size_t pos;                         // Bytes loaded into acc
+    uint64_t acc;
+    int bits;
+};
+
+/* Rounding of 16-bit samples reduced to 8 bits (value * 255 / 65535). */
+enum Reduce {
+    REDUCE_TRUNCATE,    // Rounded down, as eightBits has always done
+    REDUCE_NEAREST      // Rounded to the nearest 8-bit value
+};
+
+/* Image file formats, told apart by the first four bytes of their header. */
+enum Format {
+    FORMAT_HS16,        // Raw row-major pixels
+    FORMAT_HS1Z,        // Rows in independently compressed chunks
+    FORMAT_HS1T         // Tiles, raw or compressed, located through an index after the header
+};
+
+/* What the header of an image file says about its payload */
+struct Header {
+    enum Format format;
+    int width;
+    int height;
+    int chunk_rows;                     // HS1Z rows per chunk
+    int tile_width;                     // HS1T tile size; edge tiles are clipped to the image
+    int tile_height;
+    bool coded;                         // HS1T tiles are compressed like HS1Z chunks rather than raw
+    bool swap;                          // HS16 samples are in the opposite byte order to this machine's
+    long offset;                        // First byte after the header (the HS1T index, or pixel data)
+};
+
+/* A rectangle of an image, in pixels */
+struct Region {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/* Where the bitmap of a struct Image lives, which decides how it is released. */
+enum Storage {
+    STORAGE_HEAP,       // Allocated by makeBitmap, released with free
+    STORAGE_MAPPED      // Points into a private mapping of the source file, released with munmap
+};
+
+/* Outcome of looking a job up in the result cache (--cache). */
+enum CacheState {
+    CACHE_NONE,         // Not looked up, or its input could not be hashed
+    CACHE_MISS,         // Processed as usual, then stored
+    CACHE_HIT           // Output, CODE text and statistics copied from the cache
+};
+
+/* Stages of processing one image, as recorded by --metrics. */
+enum Stage {
+    STAGE_LOAD,
+    STAGE_MONO,
+    STAGE_CODE,
+    STAGE_SAVE,
+    STAGE_COUNT
+};
+
+/* Output format of the --metrics and --stats summaries. */
+enum MetricsFormat {
+    METRICS_OFF,
+    METRICS_TEXT,       // One aligned line per image and stage, then totals
+    METRICS_JSON        // One JSON object
+};
+
+/* Work done by the calling thread since it started. Each stage runs on one
+ * thread (parallel_rows workers neither allocate nor do I/O), so the
+ * difference across a stage is that stage's own work even when stages of
+ * different images overlap under --pipeline. */
+struct Counters {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t allocations;               // Pixel buffers, Image structs and I/O staging buffers
+};
+
+/* What one stage did to one image, summed over calls (--stream times each
+ * chunk separately). */
+struct StageMetrics {
+    double seconds;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t allocations;
+    long peak_rss_kb;                   // Peak resident set size of the process when the stage last ended
+};
+
+/* The start of a stage being timed */
+struct StageProbe {
+    double start;
+    struct Counters at;
+};
+
+/* Per-channel histograms of 16-bit samples (--stats) */
+struct Histogram {
+    uint64_t count[3][HIST_BINS];       // Red, green and blue
+};
+
+/* Exposure statistics of one channel of an image, derived from its histogram */
+struct ChannelStats {
+    uint64_t samples;                   // 0 when no statistics were collected
+    uint16_t min;
+    uint16_t max;
+    uint16_t median;
+    double mean;
+    double variance;
+    uint64_t low;                       // Samples at 0 (clipped shadows)
+    uint64_t high;                      // Samples at 65535 (clipped highlights)
+};
+
+/* One pass of a compiled --ops chain over a chunk of pixels: MONO, or a
+ * channel permutation followed by a value mapping shared by all channels. */
+struct OpStep {
+    bool gray;
+    uint8_t order[3];                   // Source channel (0 red, 1 green, 2 blue) of red, green and blue
+    uint16_t *lut;                      // Output value of each 16-bit input value, NULL for none
+};
+
+/* A chain of per-pixel operations, compiled so that every run of value
+ * mappings and channel swaps between grey conversions is a single step.
+ * All steps are applied to a chunk of a row while it is in cache, so the
+ * whole chain costs one pass over the image whatever its length. */
+struct OpChain {
+    struct OpStep steps[OPS_MAX];
+    int count;
+};
+
+/* A separable convolution kernel (--filter), applied along x then along y.
+ * With amount set, the blurred image sharpens instead (unsharp mask). */
+struct Filter {
+    int radius;                         // Taps either side of the centre, 0 for no filter
+    int16_t weights[2 * CONV_MAX_RADIUS + 1];   // Non-negative, summing to 1 << CONV_SHIFT
+    int amount;                         // Unsharp mask strength in 1/256 steps, 0 to blur
+};
+
+/* Kernels of the resampler (--resize). */
+enum ResampleMethod {
+    RESAMPLE_BOX,       // Average of the source pixels each output covers
+    RESAMPLE_BILINEAR,  // Triangle kernel
+    RESAMPLE_LANCZOS    // Windowed sinc with three lobes, sharpest
+};
+
+/* Contributions of source samples to each output sample along one axis:
+ * output i is the weighted sum of count[i] source samples from first[i],
+ * with weights in CONV_SHIFT fixed point summing to exactly 1 << CONV_SHIFT. */
+struct ResampleAxis {
+    int *first;
+    int *count;
+    int16_t *weights;                   // taps_max weights per output, unused ones last
+    int taps_max;
+};
+
+/* Push-based resampler of a stream of interleaved rows (--resize with
+ * --stream). Each pushed row is resampled along x into a ring of the last
+ * y.taps_max rows; an output row is produced along y as soon as the last
+ * input row it needs has been pushed, so memory does not depend on the
+ * image height. */
+struct Resampler {
+    int in_width, in_height;
+    int out_width, out_height;
+    struct ResampleAxis x, y;
+    uint16_t *ring;                     // y.taps_max rows of out_width pixels, resampled along x
+    uint16_t *row;                      // Output row returned by resampler_next
+    const uint16_t **taps;              // Ring rows feeding the current output row
+    int pushed;                         // Input rows pushed so far
+    int emitted;                        // Output rows returned so far
+};
+
+/* One input/output pair of a batch: its files, the images made from them
+ * while they are alive, what each stage did to it (--metrics) and the
+ * statistics of its input (--stats). */
+struct Job {
+    const char *input;
+    const char *output;
+    struct Image *in;                   // Loaded input, NULL before loading and once MONO has converted it
+    struct Image *out;                  // MONO output (the input converted in place), NULL before MONO and once saved
+    struct StageMetrics metrics[STAGE_COUNT];
+    struct ChannelStats stats[3];       // Red, green and blue statistics of the input (--stats)
+    enum CacheState cache;              // Outcome of looking up the input in the result cache (--cache)
+    uint64_t key;                       // Hash of the input and the settings, naming its cache entry (--cache)
+    FILE *code_copy;                    // Collects the CODE text of a cache miss for its entry, or NULL
+};
+
+/* The jobs of a run in command-line order, appended in amortised constant
+ * time and addressed by index. */
+struct Batch {
+    struct Job *jobs;
+    int count;
+    int capacity;
+};
+
+/* Heap images released during a batch, kept so that new_image can hand the
+ * next image of the same dimensions an existing, already faulted in buffer
+ * instead of allocating a fresh one. Holds at most POOL_IMAGES images,
+ * dropping the least recently released first. */
+struct ImagePool {
+    pthread_mutex_t lock;               // Images are released and created by several --pipeline stages
+    struct Image *spare;                // Most recently released first, linked through next
+    int count;
+};
+
+/* An image loaded from a file.
+ * The bitmap is a single contiguous buffer of height rows, each row starting
+ * stride Pixels after the previous one (stride >= width, the extra Pixels being
+ * zeroed padding). Heap bitmaps are PIXEL_ALIGN aligned; mapped bitmaps are the
+ * file's own payload and only aligned to struct Pixel.
+ * A planar image instead has pixels NULL and three planes of height rows of
+ * stride samples, each plane PIXEL_ALIGN aligned, all in one heap block. */
 struct Image {
     int width;
-    int height;
-    struct Pixel **pixels;
-    struct Image *next;
+    int height;
+    size_t stride;
+    enum Layout layout;
+    struct Pixel *pixels;   // Interleaved bitmap, NULL when planar
+    uint16_t *planes[3];    // Red, green and blue planes, NULL when interleaved
+    enum Storage storage;
+    void *map;          // Start of the file mapping when storage is STORAGE_MAPPED
+    size_t map_len;     // Length of that mapping
+    struct Image *next; // Next spare image while kept in image_pool
+};
+
+/* Output of --stream with --compress: rows are collected into one HS1Z
+ * chunk, which is encoded and written each time it fills up. */
+struct ChunkWriter {
+    struct Image rows;                  // Interleaved chunk, its height the rows collected so far
+    int capacity;                       // Rows per chunk
+    uint8_t *buf;                       // Encoded chunk, after its 4-byte length
+};
+
+struct Batch batch;  // Jobs of this run, global so the report at exit can still read them
+
+bool pad_rows = false;  // Pad bitmap rows to a multiple of ROW_ALIGN_PIXELS (--pad-rows)
+enum Layout image_layout = LAYOUT_INTERLEAVED;  // Layout of loaded images (--planar)
+bool map_input = true;  // Map input files and use their payload as the bitmap when possible (--no-mmap)
+enum WriteMode write_mode = WRITE_STDIO;    // Output path of save_image (--writev)
+bool fsync_on_close = false;                // Flush saved images to stable storage before closing (--fsync)
+enum Simd simd = SIMD_AUTO;                 // Kernel instruction set (--simd), never SIMD_AUTO after resolve_simd
+enum ByteOrder input_order = ORDER_NATIVE;  // Byte order of HS16 input samples (--input-order)
+int thread_count = 1;                       // Threads working on each image (--threads), 0 for one per CPU
+struct ThreadPool *pool;                    // Workers for parallel_rows, NULL when thread_count is 1
+struct ImagePool image_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+bool compress_output = false;               // Save images as HS1Z rather than HS16 (--compress)
+int tile_width, tile_height;                // Save images as HS1T with tiles of this size (--tile), 0 for untiled
+struct Region region;                       // Part of each input to load (--region), all of it when width is 0
+int pyramid_levels = 0;                     // Half-size levels saved beside each output (--pyramid), or PYRAMID_AUTO
+bool recycle_images = true;                 // Reuse released image buffers through image_pool (--no-recycle)
+bool pipelined = false;                     // Overlap loading, MONO and CODE/saving across images (--pipeline)
+bool streaming = false;                     // Convert images a chunk of rows at a time (--stream)
+const char *cache_dir;                      // Directory of the result cache (--cache), NULL for none
+int async_depth = 0;                        // Reads and writes in flight across the batch (--async), 0 for blocking I/O
+enum AioBackend async_backend = AIO_AUTO;   // Backend of --async (--async-backend)
+enum Reduce code_reduce = REDUCE_TRUNCATE;  // 16 to 8-bit rounding of CODE output (--reduce)
+struct OpChain op_chain;                    // Operations of the transform stage (--ops), MONO alone by default
+struct Filter image_filter;                 // Kernel applied after op_chain (--filter), none by default
+int resize_width, resize_height;            // Output size of --resize, 0 to follow the aspect ratio; both 0 without it
+enum ResampleMethod resize_method = RESAMPLE_LANCZOS;
+enum MetricsFormat metrics_format = METRICS_OFF;    // Summary printed at exit (--metrics)
+enum MetricsFormat stats_format = METRICS_OFF;      // Input statistics printed at exit (--stats)
+_Thread_local struct Counters counters;     // Work of the calling thread, always counted
+
+/* Pointer to the first Pixel of row i of interleaved img */
+static inline struct Pixel *image_row(const struct Image *img, int i)
+{
+    return img->pixels + (size_t)i * img->stride;
+}
+
+/* Pointer to the first sample of row i of channel c (0 red, 1 green, 2 blue) of planar img */
+static inline uint16_t *plane_row(const struct Image *img, int c, int i)
+{
+    return img->planes[c] + (size_t)i * img->stride;
+}
+
+/* The pixel at row i, column j of img, in either layout */
+static inline struct Pixel image_pixel(const struct Image *img, int i, int j)
+{
+    if (img->layout == LAYOUT_PLANAR)
+        return (struct Pixel){plane_row(img, 0, i)[j], plane_row(img, 1, i)[j], plane_row(img, 2, i)[j]};
+    return image_row(img, i)[j];
+}
+
+/* An image sharing the bitmap of img, whose top-left pixel is (x, y) of img.
+ * Views are never freed; they only live while img does. */
+static inline struct Image image_view(const struct Image *img, int x, int y, int width, int height)
+{
+    struct Image view = *img;
+    view.width = width;
+    view.height = height;
+    view.next = NULL;
+    if (img->layout == LAYOUT_PLANAR)
+        for (int c = 0; c < 3; c++)
+            view.planes[c] = plane_row(img, c, y) + x;
+    else
+        view.pixels = image_row(img, y) + x;
+    return view;
+}
+
+/* Whether img holds a bitmap in either layout */
+static inline bool has_bitmap(const struct Image *img)
+{
+    return img->layout == LAYOUT_PLANAR ? img->planes[0] != NULL : img->pixels != NULL;
+}
+
+/* Release a struct Image and its bitmap */
+void release_image(struct Image *img)
+{
+    /* The whole bitmap is one allocation (or one mapping), freed before the structure holding it */
+    switch (img->storage) {
+        case STORAGE_HEAP: free(img->layout == LAYOUT_PLANAR ? (void *)img->planes[0] : (void *)img->pixels); break;
+        case STORAGE_MAPPED: munmap(img->map, img->map_len); break;
+    }
+    free(img);
+}
+
+/* Take a spare image of the given dimensions and layout out of image_pool.
+ * Returns NULL when there is none. */
+struct Image *image_pool_take(int width, int height, enum Layout layout)
+{
+    pthread_mutex_lock(&image_pool.lock);
+    struct Image **p = &image_pool.spare;
+    while (*p != NULL && ((*p)->width != width || (*p)->height != height || (*p)->layout != layout))
+        p = &(*p)->next;
+    struct Image *img = *p;
+    if (img != NULL) {
+        *p = img->next;
+        img->next = NULL;
+        image_pool.count--;
+    }
+    pthread_mutex_unlock(&image_pool.lock);
+    return img;
+}
+
+/* Keep heap image img in image_pool, releasing the least recently kept
+ * image when that makes more than POOL_IMAGES */
+void image_pool_give(struct Image *img)
+{
+    struct Image *evicted = NULL;
+    pthread_mutex_lock(&image_pool.lock);
+    img->next = image_pool.spare;
+    image_pool.spare = img;
+    if (++image_pool.count > POOL_IMAGES) {
+        struct Image *p = image_pool.spare;
+        while (p->next->next != NULL)
+            p = p->next;
+        evicted = p->next;
+        p->next = NULL;
+        image_pool.count--;
+    }
+    pthread_mutex_unlock(&image_pool.lock);
+
+    if (evicted != NULL)
+        release_image(evicted);
+}
+
+/* Release every spare image. Registered with atexit by main. */
+void image_pool_drain(void)
+{
+    pthread_mutex_lock(&image_pool.lock);
+    struct Image *img = image_pool.spare;
+    image_pool.spare = NULL;
+    image_pool.count = 0;
+    pthread_mutex_unlock(&image_pool.lock);
+
+    while (img != NULL) {
+        struct Image *next = img->next;
+        release_image(img);
+        img = next;
+    }
+}
+
+/* Free a struct Image. Heap images are kept in image_pool for reuse unless
+ * --no-recycle was given. */
+void free_image(struct Image *img)
+{
+    if (recycle_images && img->storage == STORAGE_HEAP)
+        image_pool_give(img);
+    else
+        release_image(img);
+}
+
+/* Append a job for the files input and output to b.
+ * Returns false when out of memory. */
+bool batch_add(struct Batch *b, const char *input, const char *output)
+{
+    if (b->count == b->capacity) {
+        int capacity = b->capacity > 0 ? 2 * b->capacity : 16;
+        struct Job *jobs = realloc(b->jobs, (size_t)capacity * sizeof *jobs);
+        if (jobs == NULL)
+            return false;
+        b->jobs = jobs;
+        b->capacity = capacity;
+    }
+    b->jobs[b->count++] = (struct Job){.input = input, .output = output};
+    return true;
+}
+
+/* Free the jobs of the global batch and the images they still hold.
+ * Registered with atexit by main, so every exit path releases them. */
+void free_batch(void)
+{
+    for (int i = 0; i < batch.count; i++) {
+        if (batch.jobs[i].in != NULL)
+            free_image(batch.jobs[i].in);
+        if (batch.jobs[i].out != NULL)
+            free_image(batch.jobs[i].out);
+    }
+    free(batch.jobs);
+    batch.jobs = NULL;
+    batch.count = batch.capacity = 0;
+}
+
+/* Reading and writing whole rows relies on struct Pixel matching the file's
+ * red, green, blue sequence of 16-bit samples exactly. */
+_Static_assert(sizeof(struct Pixel) == 3 * sizeof(uint16_t), "struct Pixel must not be padded");
+
+/* Seconds on the monotonic clock */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Start timing a stage on the calling thread */
+static inline void stage_begin(struct StageProbe *probe)
+{
+    if (metrics_format == METRICS_OFF)
+        return;
+    probe->start = now();
+    probe->at = counters;
+}
+
+/* Add the time and work since stage_begin(probe) to the record of stage of
+ * job. A job's stage is only ever run by one thread at a time, so no lock is
+ * needed. */
+void stage_end(const struct StageProbe *probe, struct Job *job, enum Stage stage)
+{
+    if (metrics_format == METRICS_OFF)
+        return;
+    struct StageMetrics *m = &job->metrics[stage];
+    m->seconds += now() - probe->start;
+    m->bytes_read += counters.bytes_read - probe->at.bytes_read;
+    m->bytes_written += counters.bytes_written - probe->at.bytes_written;
+    m->allocations += counters.allocations - probe->at.allocations;
+
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        m->peak_rss_kb = ru.ru_maxrss;  // Kilobytes on Linux
+}
+
+const char *const stage_names[STAGE_COUNT] = {"load", "mono", "code", "save"};
+
+/* Print the per-job, per-stage records of the global batch and their totals
+ * to stderr, where they cannot mix with the CODE output. Registered with
+ * atexit by main, so a batch that fails part way still reports what it did. */
+void report_metrics(void)
+{
+    struct StageMetrics total[STAGE_COUNT] = {{0}};
+    for (int i = 0; i < batch.count; i++)
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const struct StageMetrics *m = &batch.jobs[i].metrics[s];
+            total[s].seconds += m->seconds;
+            total[s].bytes_read += m->bytes_read;
+            total[s].bytes_written += m->bytes_written;
+            total[s].allocations += m->allocations;
+            if (m->peak_rss_kb > total[s].peak_rss_kb)
+                total[s].peak_rss_kb = m->peak_rss_kb;
+        }
+
+    if (metrics_format == METRICS_JSON) {
+        fprintf(stderr, "{\"images\": [");
+        for (int i = 0; i <= batch.count; i++) {
+            const struct StageMetrics *m = i < batch.count ? batch.jobs[i].metrics : total;
+            if (i < batch.count)
+                fprintf(stderr, "%s\n  {\"input\": \"%s\", \"output\": \"%s\", ",
+                        i > 0 ? "," : "", batch.jobs[i].input, batch.jobs[i].output);
+            else
+                fprintf(stderr, "],\n \"total\": {");
+            for (int s = 0; s < STAGE_COUNT; s++)
+                fprintf(stderr, "%s\"%s\": {\"seconds\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+                                "\"allocations\": %llu, \"peak_rss_kb\": %ld}",
+                        s > 0 ? ", " : "", stage_names[s], m[s].seconds,
+                        (unsigned long long)m[s].bytes_read, (unsigned long long)m[s].bytes_written,
+                        (unsigned long long)m[s].allocations, m[s].peak_rss_kb);
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-24s %-5s %12s %14s %14s %8s %12s\n",
+            "image", "stage", "seconds", "read", "written", "allocs", "peak rss kB");
+    for (int i = 0; i <= batch.count; i++) {
+        const struct StageMetrics *m = i < batch.count ? batch.jobs[i].metrics : total;
+        for (int s = 0; s < STAGE_COUNT; s++)
+            fprintf(stderr, "%-24s %-5s %12.6f %14llu %14llu %8llu %12ld\n",
+                    i < batch.count ? batch.jobs[i].input : "total", stage_names[s], m[s].seconds,
+                    (unsigned long long)m[s].bytes_read, (unsigned long long)m[s].bytes_written,
+                    (unsigned long long)m[s].allocations, m[s].peak_rss_kb);
+    }
+}
+
+const char *const channel_names[3] = {"red", "green", "blue"};
+
+/* Print the input statistics of every job of the global batch that got as
+ * far as being loaded to stderr, like report_metrics. The standard deviation
+ * is printed rather than the variance, and clipped samples as a percentage. */
+void report_stats(void)
+{
+    if (stats_format == METRICS_JSON) {
+        fprintf(stderr, "{\"images\": [");
+        bool first = true;
+        for (int i = 0; i < batch.count; i++) {
+            const struct ChannelStats *st = batch.jobs[i].stats;
+            if (st[0].samples == 0)
+                continue;
+            fprintf(stderr, "%s\n  {\"input\": \"%s\"", first ? "" : ",", batch.jobs[i].input);
+            for (int c = 0; c < 3; c++)
+                fprintf(stderr, ", \"%s\": {\"samples\": %llu, \"min\": %u, \"max\": %u, \"median\": %u, "
+                                "\"mean\": %.3f, \"stddev\": %.3f, \"low\": %llu, \"high\": %llu}",
+                        channel_names[c], (unsigned long long)st[c].samples, st[c].min, st[c].max, st[c].median,
+                        st[c].mean, sqrt(st[c].variance), (unsigned long long)st[c].low, (unsigned long long)st[c].high);
+            fprintf(stderr, "}");
+            first = false;
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-24s %-5s %6s %6s %6s %10s %10s %7s %7s\n",
+            "image", "chan", "min", "max", "median", "mean", "stddev", "low %", "high %");
+    for (int i = 0; i < batch.count; i++) {
+        const struct ChannelStats *st = batch.jobs[i].stats;
+        for (int c = 0; c < 3 && st[0].samples > 0; c++)
+            fprintf(stderr, "%-24s %-5s %6u %6u %6u %10.1f %10.1f %7.3f %7.3f\n",
+                    batch.jobs[i].input, channel_names[c], st[c].min, st[c].max, st[c].median,
+                    st[c].mean, sqrt(st[c].variance),
+                    100.0 * st[c].low / st[c].samples, 100.0 * st[c].high / st[c].samples);
+    }
+}
+
+/* Create a dinamically allocated Pixel bitmap of m rows of n Pixels, as one
+ * PIXEL_ALIGN aligned block. The row stride (in Pixels) is stored in *stride:
+ * n, or n rounded up to ROW_ALIGN_PIXELS when pad_rows is set so every row
+ * starts on a cache line. Returns NULL on error. */
+struct Pixel *makeBitmap(int m, int n, size_t *stride)
+{
+    if (m <= 0 || n <= 0)
+        return NULL;
+
+    size_t s = (size_t)n;
+    if (pad_rows)
+        s = (s + ROW_ALIGN_PIXELS - 1) / ROW_ALIGN_PIXELS * ROW_ALIGN_PIXELS;
+
+    /* Reject dimensions whose byte size would overflow size_t */
+    if (s > SIZE_MAX / sizeof(struct Pixel) / (size_t)m)
+        return NULL;
+    size_t bytes = (size_t)m * s * sizeof(struct Pixel);
+
+    /* aligned_alloc requires the size to be a multiple of the alignment */
+    bytes = (bytes + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+    struct Pixel *newb = aligned_alloc(PIXEL_ALIGN, bytes);
+    if (newb == NULL)
+        return NULL;
+    counters.allocations++;
+
+    /* Pixels are always overwritten before use, only the padding is cleared */
+    if (s > (size_t)n)
+        for (int i = 0; i < m; i++)
+            memset(newb + (size_t)i * s + n, 0, (s - n) * sizeof(struct Pixel));
+
+    *stride = s;
+    return newb;
+}
+
+/* Create three planes of m rows of n 16-bit samples in one block, storing
+ * the plane pointers in planes and the row stride (in samples) in *stride.
+ * Strides are padded as in makeBitmap and every plane starts PIXEL_ALIGN
+ * aligned. The first plane is the start of the block. Returns false on error. */
+bool makePlanes(int m, int n, size_t *stride, uint16_t *planes[3])
+{
+    if (m <= 0 || n <= 0)
+        return false;
+
+    size_t s = (size_t)n;
+    if (pad_rows)
+        s = (s + ROW_ALIGN_PIXELS - 1) / ROW_ALIGN_PIXELS * ROW_ALIGN_PIXELS;
+
+    /* Reject dimensions whose byte size would overflow size_t */
+    if (s > SIZE_MAX / 3 / PIXEL_ALIGN / sizeof(uint16_t) / (size_t)m)
+        return false;
+    size_t plane_bytes = (size_t)m * s * sizeof(uint16_t);
+    plane_bytes = (plane_bytes + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+
+    char *block = aligned_alloc(PIXEL_ALIGN, 3 * plane_bytes);
+    if (block == NULL)
+        return false;
+    counters.allocations++;
+
+    for (int c = 0; c < 3; c++) {
+        planes[c] = (uint16_t *)(block + c * plane_bytes);
+        /* Samples are always overwritten before use, only the padding is cleared */
+        if (s > (size_t)n)
+            for (int i = 0; i < m; i++)
+                memset(planes[c] + (size_t)i * s + n, 0, (s - n) * sizeof(uint16_t));
+    }
+
+    *stride = s;
+    return true;
+}
+
+/* Allocate a struct Image of the given dimensions and layout with an
+ * uninitialised bitmap, reusing a released one from image_pool when one
+ * matches. On error, returns NULL. */
+struct Image *new_image(int width, int height, enum Layout layout)
+{
+    struct Image *img = recycle_images ? image_pool_take(width, height, layout) : NULL;
+    if (img != NULL)
+        return img;
+
+    img = malloc(sizeof *img);
+    if (img == NULL)
+        return NULL;
+    counters.allocations++;
+
+    img->width = width;
+    img->height = height;
+    img->layout = layout;
+    img->pixels = NULL;
+    img->planes[0] = img->planes[1] = img->planes[2] = NULL;
+    img->storage = STORAGE_HEAP;
+    img->map = NULL;
+    img->map_len = 0;
+    img->next = NULL;
+
+    if (layout == LAYOUT_PLANAR)
+        makePlanes(height, width, &img->stride, img->planes);
+    else
+        img->pixels = makeBitmap(height, width, &img->stride);
+    if (!has_bitmap(img)) {
+        free(img); // Free the Image struct if pixel allocation fails
+        return NULL;
+    }
+    return img;
+}
+
+/* Number of rows staged at a time when converting images of the given width
+ * between the file's interleaved layout and planes: about IO_CHUNK_PIXELS. */
+static inline int chunk_rows(int width)
+{
+    return width >= IO_CHUNK_PIXELS ? 1 : IO_CHUNK_PIXELS / width;
+}
+
+/* Split n interleaved pixels into red, green and blue samples */
+void deinterleave_row(const struct Pixel *in, uint16_t *r, uint16_t *g, uint16_t *b, size_t n)
+{
+    for (size_t j = 0; j < n; j++) {
+        r[j] = in[j].red;
+        g[j] = in[j].green;
+        b[j] = in[j].blue;
+    }
+}
+
+/* Merge n red, green and blue samples into interleaved pixels */
+void interleave_row(const uint16_t *r, const uint16_t *g, const uint16_t *b, struct Pixel *out, size_t n)
+{
+    for (size_t j = 0; j < n; j++) {
+        out[j].red = r[j];
+        out[j].green = g[j];
+        out[j].blue = b[j];
+    }
+}
+
+/* Copy rows [row, row + n) of planar img into buf as interleaved pixels, width per row */
+void interleave_rows(const struct Image *img, int row, int n, struct Pixel *buf)
+{
+    for (int i = 0; i < n; i++)
+        interleave_row(plane_row(img, 0, row + i), plane_row(img, 1, row + i), plane_row(img, 2, row + i),
+                       buf + (size_t)i * img->width, img->width);
+}
+
+/* Claim and run bands of the current job until none are left.
+ * Called and returns with p->lock held. */
+void run_bands(struct ThreadPool *p)
+{
+    while (p->next_row < p->rows) {
+        int row0 = p->next_row;
+        int row1 = row0 + p->band_rows < p->rows ? row0 + p->band_rows : p->rows;
+        p->next_row = row1;
+        p->active++;
+
+        pthread_mutex_unlock(&p->lock);
+        p->fn(p->ctx, row0, row1);
+        pthread_mutex_lock(&p->lock);
+
+        if (--p->active == 0 && p->next_row >= p->rows)
+            pthread_cond_signal(&p->idle);
+    }
+}
+
+/* Worker thread: sleep until a job has unclaimed bands, help with it, repeat */
+void *pool_worker(void *arg)
+{
+    struct ThreadPool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        if (p->next_row < p->rows)
+            run_bands(p);
+        else
+            pthread_cond_wait(&p->wake, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Stop and join the workers of the global pool and free it */
+void destroy_pool(void)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->count; t++)
+        pthread_join(pool->threads[t], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool);
+    pool = NULL;
+}
+
+/* Start the global pool with thread_count - 1 workers (the caller of
+ * parallel_rows being the last thread). Returns false on error. */
+bool create_pool(void)
+{
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (int)cpus : 1;
+    }
+    if (thread_count <= 1)
+        return true;
+
+    pool = calloc(1, sizeof *pool);
+    if (pool == NULL)
+        return false;
+    pool->threads = malloc((thread_count - 1) * sizeof *pool->threads);
+    if (pool->threads == NULL) {
+        free(pool);
+        pool = NULL;
+        return false;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (; pool->count < thread_count - 1; pool->count++)
+        if (pthread_create(&pool->threads[pool->count], NULL, pool_worker, pool) != 0) {
+            destroy_pool();
+            return false;
+        }
+    atexit(destroy_pool);
+    return true;
+}
+
+/* Run fn(ctx, row0, row1) over disjoint bands [row0, row1) covering rows
+ * [0, rows), spread across the pool, and return once every band is done.
+ * Bands must only write their own rows, so the result does not depend on
+ * how many threads ran or which band ran where. */
+void parallel_rows(int rows, void (*fn)(void *ctx, int row0, int row1), void *ctx)
+{
+    if (pool == NULL || rows <= 1) {
+        if (rows > 0)
+            fn(ctx, 0, rows);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->submit);
+    pthread_mutex_lock(&pool->lock);
+
+    int bands = (pool->count + 1) * BANDS_PER_THREAD;
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->rows = rows;
+    pool->band_rows = (rows + bands - 1) / bands;
+    pool->next_row = 0;
+    pool->active = 0;
+    pthread_cond_broadcast(&pool->wake);
+
+    run_bands(pool);
+    while (pool->active > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pool->rows = 0;
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+/* Count n interleaved pixels into the histograms of h */
+void histogram_add_pixels(struct Histogram *h, const struct Pixel *p, size_t n)
+{
+    uint64_t *r = h->count[0], *g = h->count[1], *b = h->count[2];
+    for (size_t j = 0; j < n; j++) {
+        r[p[j].red]++;
+        g[p[j].green]++;
+        b[p[j].blue]++;
+    }
+}
+
+/* Count n samples of planes r, g and b into the histograms of h */
+void histogram_add_planes(struct Histogram *h, const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n)
+{
+    for (size_t j = 0; j < n; j++) {
+        h->count[0][r[j]]++;
+        h->count[1][g[j]]++;
+        h->count[2][b[j]]++;
+    }
+}
+
+/* Private histograms of one image_histogram call. At most thread_count
+ * bands run at once, so each running band takes a histogram nobody else is
+ * using and counts into it without locking; they are merged at the end. */
+struct HistogramReduction {
+    const struct Image *img;
+    pthread_mutex_t lock;               // Guards busy and failed
+    struct Histogram **slots;           // thread_count histograms, slot 0 the caller's, others allocated on first use
+    bool *busy;                         // Slots taken by a running band
+    bool failed;                        // A band could not allocate its histogram
+};
+
+/* parallel_rows body of image_histogram: count rows [row0, row1) of the
+ * image into a free private histogram */
+void histogram_band(void *ctx, int row0, int row1)
+{
+    struct HistogramReduction *hr = ctx;
+    const struct Image *img = hr->img;
+
+    pthread_mutex_lock(&hr->lock);
+    int k = 0;
+    while (hr->busy[k])
+        k++;
+    hr->busy[k] = true;
+    pthread_mutex_unlock(&hr->lock);
+
+    if (hr->slots[k] == NULL)
+        hr->slots[k] = calloc(1, sizeof(struct Histogram));
+    if (hr->slots[k] != NULL)
+        for (int i = row0; i < row1; i++) {
+            if (img->layout == LAYOUT_PLANAR)
+                histogram_add_planes(hr->slots[k], plane_row(img, 0, i), plane_row(img, 1, i),
+                                     plane_row(img, 2, i), img->width);
+            else
+                histogram_add_pixels(hr->slots[k], image_row(img, i), img->width);
+        }
+
+    pthread_mutex_lock(&hr->lock);
+    hr->busy[k] = false;
+    if (hr->slots[k] == NULL)
+        hr->failed = true;
+    pthread_mutex_unlock(&hr->lock);
+}
+
+/* Add the samples of img to the histograms of hist, counting bands of rows
+ * into per-thread private histograms and merging them at the end. Returns
+ * false when out of memory, leaving hist partially counted. */
+bool image_histogram(const struct Image *img, struct Histogram *hist)
+{
+    int slots = thread_count > 1 ? thread_count : 1;
+    struct HistogramReduction hr = {.img = img};
+    hr.slots = calloc(slots, sizeof *hr.slots);
+    hr.busy = calloc(slots, sizeof *hr.busy);
+    bool ok = hr.slots != NULL && hr.busy != NULL;
+    if (ok) {
+        pthread_mutex_init(&hr.lock, NULL);
+        hr.slots[0] = hist;
+        parallel_rows(img->height, histogram_band, &hr);
+        pthread_mutex_destroy(&hr.lock);
+        ok = !hr.failed;
+
+        for (int k = 1; k < slots; k++)
+            if (hr.slots[k] != NULL) {
+                for (int c = 0; c < 3; c++)
+                    for (int v = 0; v < HIST_BINS; v++)
+                        hist->count[c][v] += hr.slots[k]->count[c][v];
+                free(hr.slots[k]);
+            }
+    }
+    free(hr.slots);
+    free(hr.busy);
+    return ok;
+}
+
+/* Derive the statistics of each channel from the histograms of h. The
+ * variance is taken around the exact mean, bin by bin, so it does not lose
+ * precision the way a running sum of squares would. */
+void histogram_stats(const struct Histogram *h, struct ChannelStats stats[3])
+{
+    for (int c = 0; c < 3; c++) {
+        const uint64_t *count = h->count[c];
+        struct ChannelStats *st = &stats[c];
+        memset(st, 0, sizeof *st);
+
+        uint64_t sum = 0;
+        for (int v = 0; v < HIST_BINS; v++) {
+            st->samples += count[v];
+            sum += (uint64_t)v * count[v];
+        }
+        if (st->samples == 0)
+            continue;
+
+        st->mean = (double)sum / st->samples;
+        uint64_t seen = 0;
+        bool median_found = false;
+        for (int v = 0; v < HIST_BINS; v++) {
+            if (count[v] == 0)
+                continue;
+            if (seen == 0)
+                st->min = (uint16_t)v;
+            st->max = (uint16_t)v;
+            seen += count[v];
+            if (!median_found && 2 * seen >= st->samples) {
+                st->median = (uint16_t)v;
+                median_found = true;
+            }
+            double d = v - st->mean;
+            st->variance += d * d * count[v];
+        }
+        st->variance /= st->samples;
+        st->low = count[0];
+        st->high = count[HIST_BINS - 1];
+    }
+}
+
+/* Reverse the bytes of each of n 16-bit samples at p, in place */
+void swap_samples_scalar(uint16_t *p, size_t n)
+{
+    for (size_t j = 0; j < n; j++)
+        p[j] = __builtin_bswap16(p[j]);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void swap_samples_sse2(uint16_t *p, size_t n)
+{
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + j));
+        _mm_storeu_si128((__m128i *)(p + j), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+    swap_samples_scalar(p + j, n - j);
+}
+
+/* One byte shuffle swaps 16 samples */
+__attribute__((target("avx2")))
+void swap_samples_avx2(uint16_t *p, size_t n)
+{
+    const __m256i pairs = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + j));
+        _mm256_storeu_si256((__m256i *)(p + j), _mm256_shuffle_epi8(v, pairs));
+    }
+    swap_samples_sse2(p + j, n - j);
+}
+#endif
+
+/* Byte swap n samples in place with the kernel selected by simd */
+void swap_samples(uint16_t *p, size_t n)
+{
+    switch (simd) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2: swap_samples_avx2(p, n); return;
+        case SIMD_SSE2: swap_samples_sse2(p, n); return;
+#endif
+        default: swap_samples_scalar(p, n); return;
+    }
+}
+
+/* Read data from file into the Pixel bitmap of img, byte swapping every
+ * sample when swap is set. When hist is not NULL, every pixel read is also
+ * counted into it. */
+int readBitmap(FILE * f, struct Image *img, struct Histogram *hist, bool swap)
+{
+    size_t row_bytes = (size_t)img->width * sizeof(struct Pixel);
+    size_t count = (size_t)img->width * img->height;
+
+    /* The whole payload is read with a single fread into the start of the bitmap.
+     * Check for error, EOF would also be an error as the logic does not allow EOF 
+     * to be reached, as the read accounts for the exact amount of pixels (m*n). 
+     * On Error function returns one, which is dealt with when function is called,
+     * as memory for pointers unreacheable in this scope would have to be freed. */
+    if (hist == NULL && !swap) {
+        if (fread(img->pixels, sizeof(struct Pixel), count, f) != count)
+            return 1;
+    } else {
+        /* Counting and swapping fused into the load: the payload is read a
+         * chunk of rows at a time and each chunk swapped and counted while it
+         * is still in cache, rather than in more passes over the whole bitmap. */
+        int rows = chunk_rows(img->width);
+        for (int i = 0; i < img->height; i += rows) {
+            size_t n = (size_t)(img->height - i < rows ? img->height - i : rows) * img->width;
+            struct Pixel *chunk = (struct Pixel *)((char *)img->pixels + i * row_bytes);
+            if (fread(chunk, sizeof(struct Pixel), n, f) != n)
+                return 1;
+            if (swap)
+                swap_samples((uint16_t *)chunk, n * 3);
+            if (hist != NULL)
+                histogram_add_pixels(hist, chunk, n);
+        }
+    }
+
+    /* Padded rows are spread out in place, last row first so no row is
+     * overwritten before it has been moved, then their padding is cleared. */
+    if (img->stride > (size_t)img->width)
+        for (int i = img->height - 1; i >= 0; i--) {
+            memmove(image_row(img, i), (char *)img->pixels + i * row_bytes, row_bytes);
+            memset(image_row(img, i) + img->width, 0, (img->stride - img->width) * sizeof(struct Pixel));
+        }
+
+    return 0;
+}
+
+/* Read data from file into the planes of planar img, staging a chunk of
+ * interleaved rows at a time, each chunk byte swapped when swap is set and
+ * counted into hist unless it is NULL. Returns one on error, like readBitmap. */
+int readPlanes(FILE *f, struct Image *img, struct Histogram *hist, bool swap)
+{
+    int rows = chunk_rows(img->width);
+    struct Pixel *buf = malloc((size_t)rows * img->width * sizeof(struct Pixel));
+    if (buf == NULL)
+        return 1;
+
+    for (int i = 0; i < img->height; i += rows) {
+        int n = img->height - i < rows ? img->height - i : rows;
+        size_t count = (size_t)n * img->width;
+        if (fread(buf, sizeof(struct Pixel), count, f) != count) {
+            free(buf);
+            return 1;
+        }
+        if (swap)
+            swap_samples((uint16_t *)buf, count * 3);
+        if (hist != NULL)
+            histogram_add_pixels(hist, buf, count);
+        for (int k = 0; k < n; k++)
+            deinterleave_row(buf + (size_t)k * img->width,
+                             plane_row(img, 0, i + k), plane_row(img, 1, i + k), plane_row(img, 2, i + k), img->width);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* Map the file behind f and return a struct Image whose bitmap is the pixel
+ * payload starting at offset, without copying it. The mapping is private and
+ * writable, so transforms may modify the image without touching the file.
+ * Returns NULL when the file cannot be mapped or is too short, in which case
+ * the caller falls back to readBitmap. */
+struct Image *map_image(FILE *f, long offset, int width, int height)
+{
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    /* The payload must be entirely inside the file, otherwise touching the
+     * missing pages would raise SIGBUS instead of a read error. */
+    size_t payload = (size_t)width * height * sizeof(struct Pixel);
+    if (st.st_size < offset || (size_t)(st.st_size - offset) < payload)
+        return NULL;
+
+    struct Image *img = malloc(sizeof *img);
+    if (img == NULL)
+        return NULL;
+    counters.allocations++;
+
+    img->map_len = (size_t)st.st_size;
+    img->map = mmap(NULL, img->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (img->map == MAP_FAILED) {
+        free(img);
+        return NULL;
+    }
+    madvise(img->map, img->map_len, MADV_SEQUENTIAL);
+
+    img->width = width;
+    img->height = height;
+    img->stride = (size_t)width;
+    img->layout = LAYOUT_INTERLEAVED;
+    img->pixels = (struct Pixel *)((char *)img->map + offset);
+    img->planes[0] = img->planes[1] = img->planes[2] = NULL;
+    img->storage = STORAGE_MAPPED;
+    img->next = NULL;
+    return img;
+}
+
+/* Parse the header field at *p, one or more whitespace characters then a
+ * decimal number no greater than INT_MAX, into *value, and move *p past it.
+ * Returns false if there is no such field before end. */
+static bool header_field(const char **p, const char *end, int *value)
+{
+    const char *s = *p;
+    if (s == end || !isspace((unsigned char)*s))
+        return false;
+    while (s < end && isspace((unsigned char)*s))
+        s++;
+
+    const char *digits = s;
+    long long v = 0;
+    while (s < end && isdigit((unsigned char)*s) && v <= INT_MAX)
+        v = v * 10 + (*s++ - '0');
+    if (s == digits || v > INT_MAX)
+        return false;
+    *value = (int)v;
+    *p = s;
+    return true;
+}
+
+/* Parse the header at the start of the len bytes of buf into *h, without
+ * its byte order. Returns 0 on success, 1 for an unknown format and 2 for
+ * missing or invalid fields, or a header longer than buf. */
+int parse_header(const char *buf, size_t len, struct Header *h)
+{
+    if (len < 4)
+        return 1;
+    if (memcmp(buf, IMG_FORMAT, 4) == 0) h->format = FORMAT_HS16;
+    else if (memcmp(buf, ZIMG_FORMAT, 4) == 0) h->format = FORMAT_HS1Z;
+    else if (memcmp(buf, TIMG_FORMAT, 4) == 0) h->format = FORMAT_HS1T;
+    else return 1;
+
+    /* Width and height, the fields of the variant, then the single
+     * whitespace character that separates the header from the payload */
+    const char *p = buf + 4, *end = buf + len;
+    int coded = 0;
+    h->chunk_rows = h->tile_width = h->tile_height = 0;
+    bool ok = header_field(&p, end, &h->width) && header_field(&p, end, &h->height)
+              && h->width > 0 && h->height > 0;
+    if (ok && h->format == FORMAT_HS1Z)
+        ok = header_field(&p, end, &h->chunk_rows) && h->chunk_rows > 0;
+    if (ok && h->format == FORMAT_HS1T)
+        ok = header_field(&p, end, &h->tile_width) && header_field(&p, end, &h->tile_height)
+             && header_field(&p, end, &coded) && h->tile_width > 0 && h->tile_height > 0 && coded <= 1;
+    if (!ok || p == end || !isspace((unsigned char)*p))
+        return 2;
+    h->coded = coded == 1;
+    h->offset = p + 1 - buf;
+    return 0;
+}
+
+/* Parse the header read from the start of filename, len bytes of buf, and
+ * check that the payload it describes fits in the file open as fd before
+ * anything is allocated for it. HS16 samples are taken to be in
+ * input_order. On error, prints an error message and returns false. */
+bool check_header(const char *buf, size_t len, int fd, const char *filename, struct Header *h)
+{
+    int parsed = parse_header(buf, len, h);
+    if (parsed == 1) {
+        fprintf(stderr, "File %s is not in HS16 format.\n", filename);
+        return false;
+    }
+    if (parsed == 2) {
+        fprintf(stderr, "File %s does not provide appropiate width and height dimensions.\n", filename);
+        return false;
+    }
+
+    /* The smallest payload the header allows: every pixel of HS16, a length
+     * per chunk of HS1Z, the index of HS1T. Sizes of files that are not
+     * regular cannot be known ahead of the read. */
+    uint64_t pixels = (uint64_t)h->width * h->height;
+    uint64_t need = h->format == FORMAT_HS16 ? pixels * sizeof(struct Pixel)
+                  : h->format == FORMAT_HS1Z ? 4 * (uint64_t)((h->height + h->chunk_rows - 1) / h->chunk_rows)
+                  : TILE_INDEX_ENTRY * (uint64_t)((h->width + h->tile_width - 1) / h->tile_width)
+                                     * (uint64_t)((h->height + h->tile_height - 1) / h->tile_height);
+    struct stat st;
+    if (pixels > SIZE_MAX / sizeof(struct Pixel) || fstat(fd, &st) != 0
+        || (S_ISREG(st.st_mode) && (uint64_t)st.st_size - h->offset < need)) {
+        fprintf(stderr, "File %s is too short for its %dx%d header.\n", filename, h->width, h->height);
+        return false;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    h->swap = h->format == FORMAT_HS16 && input_order == ORDER_LITTLE;
+#else
+    h->swap = h->format == FORMAT_HS16 && input_order == ORDER_BIG;
+#endif
+    return true;
+}
+
+/* Read the header of the HS16, HS1Z or HS1T file open as f into *h,
+ * leaving f at the first byte after it. The header is read as one block of
+ * at most HEADER_MAX bytes and checked by check_header. On error, prints an
+ * error message naming filename and returns false. */
+bool read_header(FILE *f, const char *filename, struct Header *h)
+{
+    char buf[HEADER_MAX];
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    return check_header(buf, len, fileno(f), filename, h) && fseek(f, h->offset, SEEK_SET) == 0;
+}
+
+/* Read len bytes at offset of fd into buf, resuming after partial reads and
+ * interrupted calls. Returns false on error or end of file. */
+bool pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf = (char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/* Clip r to a width x height image into *out. Returns false if none of r is inside. */
+bool clip_region(const struct Region *r, int width, int height, struct Region *out)
+{
+    if (r->x < 0 || r->y < 0)
+        return false;
+    int x1 = r->x + r->width < width ? r->x + r->width : width;
+    int y1 = r->y + r->height < height ? r->y + r->height : height;
+    out->x = r->x;
+    out->y = r->y;
+    out->width = x1 - r->x;
+    out->height = y1 - r->y;
+    return out->width > 0 && out->height > 0;
+}
+
+/* A new image holding rectangle r of src, in the same layout. Returns NULL
+ * when out of memory. */
+struct Image *crop_image(const struct Image *src, const struct Region *r)
+{
+    struct Image *img = new_image(r->width, r->height, src->layout);
+    if (img == NULL)
+        return NULL;
+    for (int i = 0; i < r->height; i++) {
+        if (src->layout == LAYOUT_PLANAR)
+            for (int c = 0; c < 3; c++)
+                memcpy(plane_row(img, c, i), plane_row(src, c, r->y + i) + r->x, r->width * sizeof(uint16_t));
+        else
+            memcpy(image_row(img, i), image_row(src, r->y + i) + r->x, r->width * sizeof(struct Pixel));
+    }
+    return img;
+}
+
+/* Append the low n bits of value to bw, n at most 32 */
+static inline void bits_put(struct BitWriter *bw, uint32_t value, int n)
+{
+    bw->acc = (bw->acc << n) | value;
+    bw->bits += n;
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->out[bw->len++] = (uint8_t)(bw->acc >> bw->bits);
+    }
+}
+
+/* Complete the last byte of bw with zero bits */
+static inline void bits_flush(struct BitWriter *bw)
+{
+    if (bw->bits > 0)
+        bw->out[bw->len++] = (uint8_t)(bw->acc << (8 - bw->bits));
+    bw->bits = 0;
+}
+
+/* Top up br to at least 57 bits: eight bytes at a time while they are all
+ * inside the buffer, then byte by byte, zeros past its end. */
+static inline void bits_refill(struct BitReader *br)
+{
+    if (br->pos + 8 <= br->len) {
+        uint64_t v;
+        memcpy(&v, br->in + br->pos, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        br->acc |= v >> br->bits;
+        br->pos += (63 - br->bits) >> 3;
+        br->bits |= 56;
+        return;
+    }
+    for (; br->bits <= 56; br->bits += 8, br->pos++)
+        br->acc |= (uint64_t)(br->pos < br->len ? br->in[br->pos] : 0) << (56 - br->bits);
+}
+
+/* Take the next n bits of br, 0 < n <= br->bits */
+static inline uint32_t bits_get(struct BitReader *br, int n)
+{
+    uint32_t v = (uint32_t)(br->acc >> (64 - n));
+    br->acc <<= n;
+    br->bits -= n;
+    return v;
+}
+
+/* Rice parameter for residuals whose magnitudes sum to a over n samples:
+ * the smallest k with n * 2^k >= a, from the difference of their logarithms */
+static inline int rice_k(uint32_t a, uint32_t n)
+{
+    if (a <= n)
+        return 0;
+    int k = __builtin_clz(n) - __builtin_clz(a);
+    if ((n << k) < a)
+        k++;
+    return k < 16 ? k : 16;
+}
+
+/* Predicted value of sample x of a row from its decoded neighbours (step
+ * samples apart), with the median edge detector of LOCO-I: the left or above
+ * neighbour next to an edge, their gradient a + b - c elsewhere. above is
+ * NULL on the first row of a chunk, which is predicted from the left alone. */
+static inline uint16_t med_predict(const uint16_t *row, const uint16_t *above, int x, int step)
+{
+    if (above == NULL)
+        return x > 0 ? row[(x - 1) * step] : 0;
+    int b = above[x * step];
+    int a = x > 0 ? row[(x - 1) * step] : b;
+    int c = x > 0 ? above[(x - 1) * step] : b;
+    /* The median of a, b and a + b - c, without data-dependent branches */
+    int lo = a < b ? a : b, hi = a < b ? b : a;
+    int g = a + b - c;
+    g = g < hi ? g : hi;
+    return (uint16_t)(g > lo ? g : lo);
+}
+
+/* First sample of row i of channel c of img, in either layout, with the
+ * distance between the samples of a row in *step */
+static inline uint16_t *channel_row(const struct Image *img, int c, int i, int *step)
+{
+    if (img->layout == LAYOUT_PLANAR) {
+        *step = 1;
+        return plane_row(img, c, i);
+    }
+    *step = 3;
+    return (uint16_t *)image_row(img, i) + c;
+}
+
+/* Worst-case encoded size of a chunk of n pixels: every sample escaped */
+static inline size_t zimg_chunk_bound(size_t n)
+{
+    return n * 3 * (RICE_LIMIT + 1 + 16) / 8 + 8;
+}
+
+/* Encode rows [row0, row1) of img as one HS1Z chunk into out, which must
+ * hold zimg_chunk_bound of their pixels, and return its length. Each channel
+ * in turn is coded as the residuals of med_predict, folded to unsigned
+ * (0, -1, 1, -2, ...) and Rice coded with a parameter adapted to the
+ * preceding residuals of that channel. Chunks share no state, so they can be
+ * coded and decoded independently. */
+size_t zimg_encode_chunk(const struct Image *img, int row0, int row1, uint8_t *out)
+{
+    struct BitWriter bw = {.out = out};
+    for (int c = 0; c < 3; c++) {
+        uint32_t a = RICE_INIT, n = 1;
+        const uint16_t *above = NULL;
+        for (int i = row0; i < row1; i++) {
+            int step;
+            const uint16_t *row = channel_row(img, c, i, &step);
+            for (int x = 0; x < img->width; x++) {
+                uint16_t d = (uint16_t)(row[x * step] - med_predict(row, above, x, step));
+                uint32_t u = (uint16_t)((d << 1) ^ -(d >> 15));
+                int k = rice_k(a, n);
+                uint32_t q = u >> k;
+                if (q < RICE_LIMIT) {
+                    bits_put(&bw, 1, q + 1);
+                    bits_put(&bw, u & ((1u << k) - 1), k);
+                } else {
+                    bits_put(&bw, 1, RICE_LIMIT + 1);
+                    bits_put(&bw, u, 16);
+                }
+                a += u;
+                if (++n == RICE_RESET) {
+                    a >>= 1;
+                    n >>= 1;
+                }
+            }
+            above = row;
+        }
+    }
+    bits_flush(&bw);
+    return bw.len;
+}
+
+/* Decode the HS1Z chunk of len bytes at in into rows [row0, row1) of img,
+ * the inverse of zimg_encode_chunk. Returns false if the chunk is corrupt. */
+bool zimg_decode_chunk(const uint8_t *in, size_t len, struct Image *img, int row0, int row1)
+{
+    struct BitReader br = {.in = in, .len = len};
+    for (int c = 0; c < 3; c++) {
+        uint32_t a = RICE_INIT, n = 1;
+        const uint16_t *above = NULL;
+        for (int i = row0; i < row1; i++) {
+            int step;
+            uint16_t *row = channel_row(img, c, i, &step);
+            for (int x = 0; x < img->width; x++) {
+                bits_refill(&br);
+                int zeros = br.acc == 0 ? 64 : __builtin_clzll(br.acc);
+                if (zeros > RICE_LIMIT)
+                    return false;
+                bits_get(&br, zeros + 1);
+                int k = rice_k(a, n);
+                uint32_t u;
+                if (zeros == RICE_LIMIT)
+                    u = bits_get(&br, 16);
+                else
+                    u = (uint32_t)zeros << k | (k > 0 ? bits_get(&br, k) : 0);
+                uint16_t d = (uint16_t)((u >> 1) ^ -(u & 1));
+                row[x * step] = (uint16_t)(med_predict(row, above, x, step) + d);
+                a += u;
+                if (++n == RICE_RESET) {
+                    a >>= 1;
+                    n >>= 1;
+                }
+            }
+            above = row;
+        }
+    }
+    /* Every bit taken must have come from the chunk, not the zero fill */
+    return br.pos * 8 - br.bits <= len * 8;
+}
+
+/* Chunks of one HS1Z image being decoded or encoded, shared by bands of chunks */
+struct ZChunks {
+    struct Image *img;
+    int chunk_rows;
+    const uint8_t **data;               // Start of each encoded chunk
+    size_t *len;                        // Its length
+    bool *ok;                           // Whether it decoded, one flag per chunk so bands never share one
+};
+
+/* parallel_rows body of load_compressed: decode chunks [k0, k1) */
+void zimg_decode_band(void *ctx, int k0, int k1)
+{
+    struct ZChunks *z = ctx;
+    for (int k = k0; k < k1; k++) {
+        int row0 = k * z->chunk_rows;
+        int row1 = row0 + z->chunk_rows < z->img->height ? row0 + z->chunk_rows : z->img->height;
+        z->ok[k] = zimg_decode_chunk(z->data[k], z->len[k], z->img, row0, row1);
+    }
+}
+
+/* Little-endian 32-bit length prefix of an HS1Z chunk */
+static inline uint32_t zimg_get_len(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void zimg_put_len(uint8_t *p, uint32_t len)
+{
+    for (int k = 0; k < 4; k++)
+        p[k] = (uint8_t)(len >> 8 * k);
+}
+
+/* Load rectangle r of the HS1Z file open as f, described by *h, into a new
+ * image. Only the chunks holding rows of r are read: the chunk lengths in
+ * front of them are read to find the first one, then the run of chunks is
+ * read at once and decoded in parallel into an image of their full rows,
+ * which is cropped to r unless it is all of it. On error, prints an error
+ * message naming filename and returns NULL. */
+struct Image *load_compressed(FILE *f, const struct Header *h, const char *filename, const struct Region *r)
+{
+    int fd = fileno(f);
+    int first = r->y / h->chunk_rows;
+    int chunks = (r->y + r->height - 1) / h->chunk_rows + 1 - first;
+    int rows = (first + chunks) * h->chunk_rows < h->height ? chunks * h->chunk_rows : h->height - first * h->chunk_rows;
+
+    struct ZChunks z = {.chunk_rows = h->chunk_rows};
+    z.data = malloc(chunks * sizeof *z.data);
+    z.len = malloc(chunks * sizeof *z.len);
+    z.ok = malloc(chunks * sizeof *z.ok);
+    uint8_t *data = NULL;
+    bool ok = z.data != NULL && z.len != NULL && z.ok != NULL;
+    counters.allocations += 3;
+
+    /* Walk the length prefixes up to the last chunk needed. No chunk can be
+     * longer than its worst-case coding. */
+    size_t bound = zimg_chunk_bound((size_t)h->chunk_rows * h->width);
+    off_t pos = h->offset, start = 0;
+    size_t size = 0;
+    for (int k = 0; ok && k < first + chunks; k++) {
+        uint8_t prefix[4];
+        ok = pread_all(fd, prefix, 4, pos) && zimg_get_len(prefix) <= bound;
+        if (k == first)
+            start = pos;
+        if (ok && k >= first) {
+            z.len[k - first] = zimg_get_len(prefix);
+            size += 4 + z.len[k - first];
+        }
+        pos += 4 + (off_t)zimg_get_len(prefix);
+    }
+    counters.bytes_read += (uint64_t)h->offset + 4 * (uint64_t)first;
+
+    if (ok) {
+        data = malloc(size);
+        z.img = new_image(h->width, rows, image_layout);
+        if (data == NULL || z.img == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", h->width, rows, filename);
+            ok = false;
+        } else {
+            counters.allocations++;
+            ok = pread_all(fd, data, size, start);
+            counters.bytes_read += size;
+            for (size_t k = 0, at = 4; ok && k < (size_t)chunks; at += z.len[k] + 4, k++)
+                z.data[k] = data + at;
+            if (ok)
+                parallel_rows(chunks, zimg_decode_band, &z);
+            for (int k = 0; ok && k < chunks; k++)
+                ok = z.ok[k];
+            if (!ok)
+                fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+        }
+    } else {
+        fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+    }
+
+    /* Keep only the rows and columns of r */
+    struct Image *img = ok ? z.img : NULL;
+    struct Region within = {r->x, r->y - first * h->chunk_rows, r->width, r->height};
+    if (ok && (r->width < h->width || r->height < rows)) {
+        img = crop_image(z.img, &within);
+        if (img == NULL)
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", r->width, r->height, filename);
+    }
+    if (z.img != NULL && z.img != img)
+        free_image(z.img);
+    free(data);
+    free(z.data);
+    free(z.len);
+    free(z.ok);
+    return img;
+}
+
+/* Load rectangle r of the HS16 file open as f, described by *h, reading
+ * only the part of each row of r inside it. On error, prints an error
+ * message naming filename and returns NULL. */
+struct Image *load_raw_region(FILE *f, const struct Header *h, const char *filename, const struct Region *r)
+{
+    struct Image *img = new_image(r->width, r->height, image_layout);
+    struct Pixel *buf = image_layout == LAYOUT_PLANAR ? malloc(r->width * sizeof *buf) : NULL;
+    if (img == NULL || (image_layout == LAYOUT_PLANAR && buf == NULL)) {
+        fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", r->width, r->height, filename);
+        if (img != NULL)
+            free_image(img);
+        free(buf);
+        return NULL;
+    }
+    if (buf != NULL)
+        counters.allocations++;
+
+    size_t row_bytes = (size_t)r->width * sizeof(struct Pixel);
+    bool ok = true;
+    for (int i = 0; ok && i < r->height; i++) {
+        off_t at = h->offset + ((off_t)(r->y + i) * h->width + r->x) * (off_t)sizeof(struct Pixel);
+        struct Pixel *row = buf != NULL ? buf : image_row(img, i);
+        ok = pread_all(fileno(f), row, row_bytes, at);
+        if (ok && h->swap)
+            swap_samples((uint16_t *)row, (size_t)r->width * 3);
+        if (ok && buf != NULL)
+            deinterleave_row(buf, plane_row(img, 0, i), plane_row(img, 1, i), plane_row(img, 2, i), r->width);
+    }
+    counters.bytes_read += (uint64_t)h->offset + r->height * row_bytes;
+    free(buf);
+
+    if (!ok) {
+        fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+        free_image(img);
+        return NULL;
+    }
+    return img;
+}
+
+/* Little-endian 64-bit field of an HS1T index entry */
+static inline uint64_t tile_get64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int k = 7; k >= 0; k--)
+        v = v << 8 | p[k];
+    return v;
+}
+
+static inline void tile_put64(uint8_t *p, uint64_t v)
+{
+    for (int k = 0; k < 8; k++)
+        p[k] = (uint8_t)(v >> 8 * k);
+}
+
+/* Copy the pixels of view to out row after row, as a raw HS1T tile */
+void tile_pack(const struct Image *view, uint8_t *out)
+{
+    size_t row_bytes = (size_t)view->width * sizeof(struct Pixel);
+    for (int i = 0; i < view->height; i++) {
+        struct Pixel *row = (struct Pixel *)(out + i * row_bytes);
+        if (view->layout == LAYOUT_PLANAR)
+            interleave_row(plane_row(view, 0, i), plane_row(view, 1, i), plane_row(view, 2, i), row, view->width);
+        else
+            memcpy(row, image_row(view, i), row_bytes);
+    }
+}
+
+/* Copy the raw HS1T tile at in, which must be aligned to a Pixel, into view */
+void tile_unpack(const uint8_t *in, struct Image *view)
+{
+    size_t row_bytes = (size_t)view->width * sizeof(struct Pixel);
+    for (int i = 0; i < view->height; i++) {
+        const struct Pixel *row = (const struct Pixel *)(in + i * row_bytes);
+        if (view->layout == LAYOUT_PLANAR)
+            deinterleave_row(row, plane_row(view, 0, i), plane_row(view, 1, i), plane_row(view, 2, i), view->width);
+        else
+            memcpy(image_row(view, i), row, row_bytes);
+    }
+}
+
+/* Tiles of one load_tiles call, shared by bands of tiles */
+struct TileLoad {
+    const struct Header *h;
+    struct Image *img;                  // The tiles' bounding rectangle of the image, starting at a tile corner
+    int across;                         // Tiles per row of img
+    const uint8_t **data;               // Each tile as stored, row-major
+    size_t *len;                        // Its length
+    bool *ok;                           // Whether it decoded, one flag per tile so bands never share one
+};
+
+/* parallel_rows body of load_tiles: decode or copy tiles [k0, k1) into place */
+void tile_load_band(void *ctx, int k0, int k1)
+{
+    struct TileLoad *t = ctx;
+    int tw = t->h->tile_width, th = t->h->tile_height;
+    for (int k = k0; k < k1; k++) {
+        int x = k % t->across * tw, y = k / t->across * th;
+        struct Image tile = image_view(t->img, x, y, x + tw < t->img->width ? tw : t->img->width - x,
+                                       y + th < t->img->height ? th : t->img->height - y);
+        if (t->h->coded) {
+            t->ok[k] = zimg_decode_chunk(t->data[k], t->len[k], &tile, 0, tile.height);
+        } else {
+            t->ok[k] = t->len[k] == (size_t)tile.width * tile.height * sizeof(struct Pixel);
+            if (t->ok[k])
+                tile_unpack(t->data[k], &tile);
+        }
+    }
+}
+
+/* Load rectangle r of the HS1T file open as f, described by *h, into a new
+ * image. Only the index entries and tiles covering r are read, each run of
+ * tiles adjacent in the file with one pread, and the tiles are decoded in
+ * parallel into an image of their bounding rectangle, which is cropped to r
+ * unless it is all of it. On error, prints an error message naming filename
+ * and returns NULL. */
+struct Image *load_tiles(FILE *f, const struct Header *h, const char *filename, const struct Region *r)
+{
+    int fd = fileno(f);
+    int tw = h->tile_width, th = h->tile_height;
+    int tiles_x = (h->width + tw - 1) / tw;
+    int tx0 = r->x / tw, ty0 = r->y / th;
+    int across = (r->x + r->width - 1) / tw + 1 - tx0;
+    int down = (r->y + r->height - 1) / th + 1 - ty0;
+    int count = across * down;
+    struct Region bounds = {tx0 * tw, ty0 * th, 0, 0};
+    bounds.width = (tx0 + across) * tw < h->width ? across * tw : h->width - bounds.x;
+    bounds.height = (ty0 + down) * th < h->height ? down * th : h->height - bounds.y;
+
+    struct TileLoad t = {.h = h, .across = across};
+    uint8_t *index = malloc((size_t)across * TILE_INDEX_ENTRY);
+    uint64_t *offset = malloc(count * sizeof *offset);
+    size_t *at = malloc(count * sizeof *at);
+    t.data = malloc(count * sizeof *t.data);
+    t.len = malloc(count * sizeof *t.len);
+    t.ok = malloc(count * sizeof *t.ok);
+    uint8_t *data = NULL;
+    bool ok = index != NULL && offset != NULL && at != NULL && t.data != NULL && t.len != NULL && t.ok != NULL;
+    counters.allocations += 6;
+
+    /* The index entries of each row of tiles, checked against the file and
+     * against the largest size a tile can have */
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    size_t bound = h->coded ? zimg_chunk_bound((size_t)tw * th) : (size_t)tw * th * sizeof(struct Pixel);
+    for (int j = 0; ok && j < down; j++) {
+        off_t entry = h->offset + ((off_t)(ty0 + j) * tiles_x + tx0) * TILE_INDEX_ENTRY;
+        ok = pread_all(fd, index, (size_t)across * TILE_INDEX_ENTRY, entry);
+        counters.bytes_read += (uint64_t)across * TILE_INDEX_ENTRY;
+        for (int i = 0; ok && i < across; i++) {
+            int k = j * across + i;
+            offset[k] = tile_get64(index + i * TILE_INDEX_ENTRY);
+            t.len[k] = tile_get64(index + i * TILE_INDEX_ENTRY + 8);
+            ok = t.len[k] <= bound && offset[k] <= (uint64_t)st.st_size && t.len[k] <= (uint64_t)st.st_size - offset[k];
+        }
+    }
+
+    /* Lay the tiles out in one buffer, each run adjacent in the file read at
+     * once; runs start 8-byte aligned so raw tiles are aligned to a Pixel */
+    size_t size = 0;
+    for (int k = 0; ok && k < count; k++) {
+        if (k == 0 || offset[k] != offset[k - 1] + t.len[k - 1])
+            size = (size + 7) & ~(size_t)7;
+        at[k] = size;
+        size += t.len[k];
+    }
+    if (ok) {
+        data = malloc(size > 0 ? size : 1);
+        t.img = new_image(bounds.width, bounds.height, image_layout);
+        if (data == NULL || t.img == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", bounds.width, bounds.height, filename);
+            ok = false;
+        } else {
+            counters.allocations++;
+            for (int k = 0, end; ok && k < count; k = end) {
+                for (end = k + 1; end < count && offset[end] == offset[end - 1] + t.len[end - 1]; end++)
+                    ;
+                size_t run = at[end - 1] + t.len[end - 1] - at[k];
+                ok = pread_all(fd, data + at[k], run, offset[k]);
+                counters.bytes_read += run;
+            }
+            for (int k = 0; k < count; k++)
+                t.data[k] = data + at[k];
+            if (ok)
+                parallel_rows(count, tile_load_band, &t);
+            for (int k = 0; ok && k < count; k++)
+                ok = t.ok[k];
+            if (!ok)
+                fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+        }
+    } else {
+        fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+    }
+    counters.bytes_read += (uint64_t)h->offset;
+
+    /* Keep only the part of the tiles inside r */
+    struct Image *img = ok ? t.img : NULL;
+    struct Region within = {r->x - bounds.x, r->y - bounds.y, r->width, r->height};
+    if (ok && (r->width < bounds.width || r->height < bounds.height)) {
+        img = crop_image(t.img, &within);
+        if (img == NULL)
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", r->width, r->height, filename);
+    }
+    if (t.img != NULL && t.img != img)
+        free_image(t.img);
+    free(data);
+    free(index);
+    free(offset);
+    free(at);
+    free(t.data);
+    free(t.len);
+    free(t.ok);
+    return img;
+}
+
+/* Opens and reads an HS16, HS1Z or HS1T image file, returning a pointer to
+ * a new struct Image of all of it, or only of rectangle part (clipped to the
+ * image) when part is not NULL. When hist is not NULL, the image's samples
+ * are counted into it: as each chunk arrives when a whole HS16 payload is
+ * read, otherwise by image_histogram. On error, prints an error message and
+ * returns NULL. */
+struct Image *load_image_counted(const char *filename, const struct Region *part, struct Histogram *hist)
+{
+    /* Open the file for reading */
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "File %s could not be opened.\n", filename);
+        return NULL;
+    }
+
+    /* Allocate the Image object, and read the image from the file. */
+
+    struct Header h;
+    if (!read_header(f, filename, &h)) {
+        fclose(f);
+        return NULL;
+    }
+    int width = h.width, height = h.height;
+
+    struct Region r = {0, 0, width, height};
+    if (part != NULL && !clip_region(part, width, height, &r)) {
+        fprintf(stderr, "Region %dx%d+%d+%d lies outside %dx%d image %s.\n",
+                part->width, part->height, part->x, part->y, width, height, filename);
+        fclose(f);
+        return NULL;
+    }
+
+    /* Compressed and tiled files are decoded rather than read or mapped, and
+     * only the rows of a part of an HS16 file are read */
+    if (h.format != FORMAT_HS16 || r.width < width || r.height < height) {
+        struct Image *img = h.format == FORMAT_HS1Z ? load_compressed(f, &h, filename, &r)
+                          : h.format == FORMAT_HS1T ? load_tiles(f, &h, filename, &r)
+                          : load_raw_region(f, &h, filename, &r);
+        fclose(f);
+        if (img != NULL && hist != NULL && !image_histogram(img, hist)) {
+            fprintf(stderr, "Unable to allocate memory for the histograms of %s.\n", filename);
+            free_image(img);
+            img = NULL;
+        }
+        return img;
+    }
+
+    /* When the payload is suitably aligned in the file, in this machine's byte
+     * order, and rows are neither padded nor split into planes, the file is
+     * mapped and its payload used as the bitmap directly. */
+    long offset = h.offset;
+    struct Image *img = NULL;
+    if (map_input && !pad_rows && image_layout == LAYOUT_INTERLEAVED && !h.swap && offset % _Alignof(struct Pixel) == 0)
+        img = map_image(f, offset, width, height);
+
+    if (img == NULL) {
+        /* Dinamically allocate the Image struct, dimension fields and Pixel bitmap. */
+        img = new_image(width, height, image_layout);
+        if (img == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", width, height, filename);
+            fclose(f);
+            return NULL;
+        }
+
+        /* Read pixel data into Pixel bitmap, or split it into planes */
+        int read_data = img->layout == LAYOUT_PLANAR ? readPlanes(f, img, hist, h.swap)
+                                                     : readBitmap(f, img, hist, h.swap);
+        if (read_data == 1) {
+            fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
+            free_image(img);
+            fclose(f);
+            return NULL;
+        }
+    }
+
+    /* Mapped payloads count as read: their pages are faulted in by the first stage touching them */
+    counters.bytes_read += (uint64_t)offset + (uint64_t)width * height * sizeof(struct Pixel);
+
+    /* Close the file */
+    fclose(f);
+
+    if (img->storage == STORAGE_MAPPED && hist != NULL && !image_histogram(img, hist)) {
+        fprintf(stderr, "Unable to allocate memory for the histograms of %s.\n", filename);
+        free_image(img);
+        return NULL;
+    }
+    return img;
+}
+
+/* Opens and reads an image file, like load_image_counted without counting */
+struct Image *load_image(const char *filename)
+{
+    return load_image_counted(filename, NULL, NULL);
+}
+
+/* Opens an image file and reads only the rectangle of width x height pixels
+ * whose top-left pixel is (x, y), clipped to the image. HS16 files are read
+ * row by row within the rectangle, HS1Z files chunk by chunk and HS1T files
+ * tile by tile, so the I/O is about the rectangle's size rather than the
+ * file's. On error, prints an error message and returns NULL. */
+struct Image *load_region(const char *filename, int x, int y, int width, int height)
+{
+    struct Region r = {x, y, width, height};
+    return load_image_counted(filename, &r, NULL);
+}
+
+/* Load the input of job, or only the --region of it. With --stats, the
+ * statistics of its samples are collected into job->stats on the way (see
+ * load_image_counted). On error, prints a message and returns NULL. */
+struct Image *load_job(struct Job *job)
+{
+    const struct Region *part = region.width > 0 ? &region : NULL;
+    if (stats_format == METRICS_OFF)
+        return load_image_counted(job->input, part, NULL);
+
+    struct Histogram *hist = calloc(1, sizeof *hist);
+    if (hist == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the histograms of %s.\n", job->input);
+        return NULL;
+    }
+    counters.allocations++;
+
+    struct Image *img = load_image_counted(job->input, part, hist);
+    if (img != NULL)
+        histogram_stats(hist, job->stats);
+    free(hist);
+    return img;
+}
+
+/* Write the whole of iov[0..cnt) to fd, resuming after partial writes and
+ * interrupted calls. The iovec array is consumed. Returns false on error. */
+bool writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        /* Skip the buffers written completely and trim the partially written one */
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/* Write planar img with its header, interleaving a chunk of rows at a time
+ * into a staging buffer that is written with fwrite to f, or with writev to
+ * fd when f is NULL. */
+bool write_planar(FILE *f, int fd, const struct Image *img, const char *header, size_t header_len)
+{
+    int rows = chunk_rows(img->width);
+    struct Pixel *buf = malloc((size_t)rows * img->width * sizeof(struct Pixel));
+    if (buf == NULL)
+        return false;
+    counters.allocations++;
+
+    struct iovec iov[2] = {{(void *)header, header_len}, {buf, 0}};
+    bool ok = f != NULL ? fwrite(header, 1, header_len, f) == header_len : writev_all(fd, iov, 1);
+
+    for (int i = 0; ok && i < img->height; i += rows) {
+        int n = img->height - i < rows ? img->height - i : rows;
+        size_t count = (size_t)n * img->width;
+        interleave_rows(img, i, n, buf);
+        if (f != NULL) {
+            ok = fwrite(buf, sizeof(struct Pixel), count, f) == count;
+        } else {
+            iov[1].iov_base = buf;
+            iov[1].iov_len = count * sizeof(struct Pixel);
+            ok = writev_all(fd, iov + 1, 1);
+        }
+    }
+
+    free(buf);
+    return ok;
+}
+
+/* Write img to open file descriptor fd with writev: one buffer for the header
+ * and one for the whole bitmap, or one per row when rows are padded. */
+bool write_vectored(int fd, const struct Image *img, const char *header, size_t header_len)
+{
+    if (img->layout == LAYOUT_PLANAR)
+        return write_planar(NULL, fd, img, header, header_len);
+
+    size_t row_bytes = (size_t)img->width * sizeof(struct Pixel);
+    bool contiguous = img->stride == (size_t)img->width;
+    int cnt = 1 + (contiguous ? 1 : img->height);
+
+    struct iovec *iov = malloc(cnt * sizeof *iov);
+    if (iov == NULL)
+        return false;
+    counters.allocations++;
+
+    iov[0].iov_base = (void *)header;
+    iov[0].iov_len = header_len;
+    if (contiguous) {
+        iov[1].iov_base = img->pixels;
+        iov[1].iov_len = row_bytes * img->height;
+    } else {
+        for (int i = 0; i < img->height; i++) {
+            iov[i + 1].iov_base = image_row(img, i);
+            iov[i + 1].iov_len = row_bytes;
+        }
+    }
+
+    bool ok = writev_all(fd, iov, cnt);
+    free(iov);
+    return ok;
+}
+
+/* Write img to open stream f: the header, then the whole bitmap in one fwrite,
+ * or one fwrite per row when rows are padded. */
+bool write_stdio(FILE *f, const struct Image *img, const char *header, size_t header_len)
+{
+    if (img->layout == LAYOUT_PLANAR)
+        return write_planar(f, -1, img, header, header_len);
+
+    if (fwrite(header, 1, header_len, f) != header_len)
+        return false;
+
+    /* Pixel values are red, green, blue 16-bit unsigned integers.
+     * fwrite is used instead of fprintf because it can specify the data type and size 
+     * (fprintf would use short unsigned int, which in some machines may not be 16-bits)*/
+    if (img->stride == (size_t)img->width) {
+        size_t count = (size_t)img->width * img->height;
+        return fwrite(img->pixels, sizeof(struct Pixel), count, f) == count;
+    }
+
+    for (int i = 0; i < img->height; i++)
+        if (fwrite(image_row(img, i), sizeof(struct Pixel), img->width, f) != (size_t)img->width)
+            return false;
+    return true;
+}
+
+/* A group of chunks of one write_compressed call, encoded in parallel */
+struct ZEncode {
+    const struct Image *img;
+    int chunk_rows;
+    int first;                          // Index in the image of the group's first chunk
+    uint8_t **buf;                      // Each chunk of the group: its 4-byte length, then its code
+    size_t *len;                        // Bytes of buf used, length included
+};
+
+/* parallel_rows body of write_compressed: encode chunks [k0, k1) of the group */
+void zimg_encode_band(void *ctx, int k0, int k1)
+{
+    struct ZEncode *z = ctx;
+    for (int k = k0; k < k1; k++) {
+        int row0 = (z->first + k) * z->chunk_rows;
+        int row1 = row0 + z->chunk_rows < z->img->height ? row0 + z->chunk_rows : z->img->height;
+        size_t n = zimg_encode_chunk(z->img, row0, row1, z->buf[k] + 4);
+        zimg_put_len(z->buf[k], (uint32_t)n);
+        z->len[k] = n + 4;
+    }
+}
+
+/* Write img as HS1Z with its header, in chunks of chunk_rows(width) rows.
+ * A group of BANDS_PER_THREAD chunks per thread is encoded in parallel, then
+ * written in order with fwrite to f, or with writev to fd when f is NULL, so
+ * memory stays bounded whatever the image size. The bytes written are
+ * stored in *written. */
+bool write_compressed(FILE *f, int fd, const struct Image *img, const char *header, size_t header_len,
+                      uint64_t *written)
+{
+    struct ZEncode z = {.img = img, .chunk_rows = chunk_rows(img->width)};
+    int chunks = (img->height + z.chunk_rows - 1) / z.chunk_rows;
+    int group = (thread_count > 1 ? thread_count : 1) * BANDS_PER_THREAD;
+    if (group > chunks)
+        group = chunks;
+
+    size_t bound = 4 + zimg_chunk_bound((size_t)z.chunk_rows * img->width);
+    z.buf = calloc(group, sizeof *z.buf);
+    z.len = malloc(group * sizeof *z.len);
+    struct iovec *iov = malloc(group * sizeof *iov);
+    bool ok = z.buf != NULL && z.len != NULL && iov != NULL;
+    for (int k = 0; ok && k < group; k++)
+        ok = (z.buf[k] = malloc(bound)) != NULL;
+    counters.allocations += 3 + group;
+
+    if (ok) {
+        iov[0].iov_base = (void *)header;
+        iov[0].iov_len = header_len;
+        ok = f != NULL ? fwrite(header, 1, header_len, f) == header_len : writev_all(fd, iov, 1);
+    }
+    *written = header_len;
+
+    for (z.first = 0; ok && z.first < chunks; z.first += group) {
+        int n = chunks - z.first < group ? chunks - z.first : group;
+        parallel_rows(n, zimg_encode_band, &z);
+        for (int k = 0; k < n; k++) {
+            iov[k].iov_base = z.buf[k];
+            iov[k].iov_len = z.len[k];
+            *written += z.len[k];
+            if (f != NULL && ok)
+                ok = fwrite(z.buf[k], 1, z.len[k], f) == z.len[k];
+        }
+        if (f == NULL)
+            ok = writev_all(fd, iov, n);
+    }
+
+    for (int k = 0; z.buf != NULL && k < group; k++)
+        free(z.buf[k]);
+    free(z.buf);
+    free(z.len);
+    free(iov);
+    return ok;
+}
+
+/* Tiles of one write_tiled group, packed or encoded in parallel */
+struct TileEncode {
+    const struct Image *img;
+    int across;                         // Tiles per row of the image
+    int first;                          // Index in the image of the group's first tile
+    uint8_t **buf;                      // Each tile of the group as stored
+    size_t *len;                        // Its length
+};
+
+/* parallel_rows body of write_tiled: store tiles [k0, k1) of the group */
+void tile_encode_band(void *ctx, int k0, int k1)
+{
+    struct TileEncode *t = ctx;
+    for (int k = k0; k < k1; k++) {
+        int x = (t->first + k) % t->across * tile_width, y = (t->first + k) / t->across * tile_height;
+        struct Image tile = image_view(t->img, x, y, x + tile_width < t->img->width ? tile_width : t->img->width - x,
+                                       y + tile_height < t->img->height ? tile_height : t->img->height - y);
+        if (compress_output) {
+            t->len[k] = zimg_encode_chunk(&tile, 0, tile.height, t->buf[k]);
+        } else {
+            tile_pack(&tile, t->buf[k]);
+            t->len[k] = (size_t)tile.width * tile.height * sizeof(struct Pixel);
+        }
+    }
+}
+
+/* Write img as HS1T with its header: the tile index, then its tiles of
+ * tile_width x tile_height pixels row-major, raw or compressed like HS1Z
+ * chunks with --compress. The index is written empty, tiles are stored a
+ * group of BANDS_PER_THREAD per thread at a time in parallel and written in
+ * order, then the index is filled in, so f or fd (used when f is NULL) must
+ * be seekable. The bytes written are stored in *written. */
+bool write_tiled(FILE *f, int fd, const struct Image *img, const char *header, size_t header_len,
+                 uint64_t *written)
+{
+    struct TileEncode t = {.img = img, .across = (img->width + tile_width - 1) / tile_width};
+    int tiles = t.across * ((img->height + tile_height - 1) / tile_height);
+    int group = (thread_count > 1 ? thread_count : 1) * BANDS_PER_THREAD;
+    if (group > tiles)
+        group = tiles;
+
+    size_t pixels = (size_t)tile_width * tile_height;
+    size_t bound = compress_output ? zimg_chunk_bound(pixels) : pixels * sizeof(struct Pixel);
+    size_t index_len = (size_t)tiles * TILE_INDEX_ENTRY;
+    uint8_t *index = calloc(index_len, 1);
+    t.buf = calloc(group, sizeof *t.buf);
+    t.len = malloc(group * sizeof *t.len);
+    struct iovec *iov = malloc(group * sizeof *iov);
+    bool ok = index != NULL && t.buf != NULL && t.len != NULL && iov != NULL;
+    for (int k = 0; ok && k < group; k++)
+        ok = (t.buf[k] = malloc(bound)) != NULL;
+    counters.allocations += 4 + group;
+
+    if (ok) {
+        struct iovec head[2] = {{(void *)header, header_len}, {index, index_len}};
+        ok = f != NULL ? fwrite(header, 1, header_len, f) == header_len && fwrite(index, 1, index_len, f) == index_len
+                       : writev_all(fd, head, 2);
+    }
+    uint64_t pos = header_len + index_len;
+
+    for (t.first = 0; ok && t.first < tiles; t.first += group) {
+        int n = tiles - t.first < group ? tiles - t.first : group;
+        parallel_rows(n, tile_encode_band, &t);
+        for (int k = 0; k < n; k++) {
+            tile_put64(index + (size_t)(t.first + k) * TILE_INDEX_ENTRY, pos);
+            tile_put64(index + (size_t)(t.first + k) * TILE_INDEX_ENTRY + 8, t.len[k]);
+            pos += t.len[k];
+            iov[k].iov_base = t.buf[k];
+            iov[k].iov_len = t.len[k];
+            if (f != NULL && ok)
+                ok = fwrite(t.buf[k], 1, t.len[k], f) == t.len[k];
+        }
+        if (f == NULL)
+            ok = writev_all(fd, iov, n);
+    }
+
+    /* Fill in the index now that every tile's place is known */
+    if (ok && f != NULL)
+        ok = fseek(f, (long)header_len, SEEK_SET) == 0 && fwrite(index, 1, index_len, f) == index_len;
+    if (ok && f == NULL) {
+        iov[0].iov_base = index;
+        iov[0].iov_len = index_len;
+        ok = lseek(fd, (off_t)header_len, SEEK_SET) == (off_t)header_len && writev_all(fd, iov, 1);
+    }
+    *written = pos;
+
+    for (int k = 0; t.buf != NULL && k < group; k++)
+        free(t.buf[k]);
+    free(t.buf);
+    free(t.len);
+    free(iov);
+    free(index);
+    return ok;
+}
+
+/* Write img to file filename. Return true on success, false on error.
+ * The file is only reported as saved once it has been closed without error
+ * (and synced first when fsync_on_close is set). */
+bool save_image(const struct Image *img, const char *filename)
+{
+    /* Format header */
+    char header[HEADER_MAX];
+    int header_len = tile_width > 0
+        ? snprintf(header, sizeof(header), "%s\t%i\t%i\t%i\t%i\t%i ", TIMG_FORMAT, img->width, img->height,
+                   tile_width, tile_height, compress_output)
+        : compress_output
+        ? snprintf(header, sizeof(header), "%s\t%i\t%i\t%i ", ZIMG_FORMAT, img->width, img->height, chunk_rows(img->width))
+        : snprintf(header, sizeof(header), "%s\t%i\t%i ", IMG_FORMAT, img->width, img->height);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header))
+        return false;
+    uint64_t written = header_len + (uint64_t)img->width * img->height * sizeof(struct Pixel);
+
+    if (write_mode == WRITE_VECTORED) {
+        /* Open the file for writing */
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return false;
+
+        bool ok = tile_width > 0 ? write_tiled(NULL, fd, img, header, header_len, &written)
+                  : compress_output ? write_compressed(NULL, fd, img, header, header_len, &written)
+                  : write_vectored(fd, img, header, header_len);
+        if (ok)
+            counters.bytes_written += written;
+        if (ok && fsync_on_close)
+            ok = fsync(fd) == 0;
+        if (close(fd) != 0)
+            ok = false;
+        return ok;
+    }
+
+    /* Open the file for writing */
+    FILE *f = fopen(filename, "w");
+    if (f == NULL)
+        return false;
+
+    bool ok = tile_width > 0 ? write_tiled(f, -1, img, header, header_len, &written)
+              : compress_output ? write_compressed(f, -1, img, header, header_len, &written)
+              : write_stdio(f, img, header, header_len);
+    if (ok)
+        counters.bytes_written += written;
+    if (ok && fsync_on_close)
+        ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+/* Average the 2x2 blocks of rows a and b, in_width pixels of channels
+ * interleaved samples each, into the out_width = (in_width + 1) / 2 pixels
+ * of out, rounding to nearest. A last odd column is averaged with itself. */
+void pyramid_row(const uint16_t *a, const uint16_t *b, uint16_t *out, int in_width, int out_width, int channels)
+{
+    for (int j = 0; j < out_width; j++) {
+        size_t l = (size_t)2 * j * channels;
+        size_t r = 2 * j + 1 < in_width ? l + channels : l;
+        for (int c = 0; c < channels; c++)
+            out[(size_t)j * channels + c] = (uint16_t)((a[l + c] + a[r + c] + b[l + c] + b[r + c] + 2) >> 2);
+    }
+}
+
+/* Source and destination of one pyramid_level call, shared by bands */
+struct PyramidStep {
+    const struct Image *src;
+    struct Image *dest;
+};
+
+/* parallel_rows body of pyramid_level: reduce rows [row0, row1) of dest.
+ * A last odd row of src is averaged with itself. */
+void pyramid_band(void *ctx, int row0, int row1)
+{
+    const struct PyramidStep *ps = ctx;
+    const struct Image *src = ps->src;
+    for (int i = row0; i < row1; i++) {
+        int a = 2 * i, b = 2 * i + 1 < src->height ? 2 * i + 1 : 2 * i;
+        if (src->layout == LAYOUT_PLANAR)
+            for (int c = 0; c < 3; c++)
+                pyramid_row(plane_row(src, c, a), plane_row(src, c, b), plane_row(ps->dest, c, i),
+                            src->width, ps->dest->width, 1);
+        else
+            pyramid_row((const uint16_t *)image_row(src, a), (const uint16_t *)image_row(src, b),
+                        (uint16_t *)image_row(ps->dest, i), src->width, ps->dest->width, 3);
+    }
+}
+
+/* A new image of half the width and height of src (rounded up), in the same
+ * layout, each pixel the mean of a 2x2 block of src. Returns NULL when out
+ * of memory. */
+struct Image *pyramid_level(const struct Image *src)
+{
+    struct PyramidStep ps = {src, new_image((src->width + 1) / 2, (src->height + 1) / 2, src->layout)};
+    if (ps.dest != NULL)
+        parallel_rows(ps.dest->height, pyramid_band, &ps);
+    return ps.dest;
+}
+
+/* Number of pyramid levels saved below a width x height output: as many as
+ * --pyramid asks for, or with PYRAMID_AUTO until the level fits in
+ * PYRAMID_MIN x PYRAMID_MIN, in both cases stopping at 1x1. */
+int pyramid_depth(int width, int height)
+{
+    int levels = 0;
+    while ((width > 1 || height > 1) &&
+           (pyramid_levels == PYRAMID_AUTO ? width > PYRAMID_MIN || height > PYRAMID_MIN : levels < pyramid_levels)) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+/* Write the file name of pyramid level of filename to name, MAX_FILENAME + 1
+ * bytes: ".L<level>" goes before the extension, so out.hs16 has level 1 in
+ * out.L1.hs16, or at the end when there is none. Returns false when the name
+ * is too long. */
+bool pyramid_name(const char *filename, int level, char *name)
+{
+    const char *base = strrchr(filename, '/');
+    base = base != NULL ? base + 1 : filename;
+    const char *ext = strrchr(base, '.');
+    if (ext == NULL || ext == base)
+        ext = base + strlen(base);
+    int n = snprintf(name, MAX_FILENAME + 1, "%.*s.L%d%s", (int)(ext - filename), filename, level, ext);
+    return n > 0 && n <= MAX_FILENAME;
+}
+
+/* Save img to filename like save_image, followed by its --pyramid levels.
+ * Each level is reduced from the one before, so only two are ever held. On
+ * a failed level, prints an error message naming it and returns false. */
+bool save_output(const struct Image *img, const char *filename)
+{
+    if (!save_image(img, filename))
+        return false;
+
+    int levels = pyramid_depth(img->width, img->height);
+    struct Image *level = NULL;
+    bool ok = true;
+    for (int k = 1; ok && k <= levels; k++) {
+        char name[MAX_FILENAME + 1];
+        if (!pyramid_name(filename, k, name)) {
+            fprintf(stderr, "File name %s is too long for its pyramid levels.\n", filename);
+            ok = false;
+            break;
+        }
+        struct Image *next = pyramid_level(level != NULL ? level : img);
+        if (level != NULL)
+            free_image(level);
+        level = next;
+        if (level == NULL) {
+            fprintf(stderr, "Unable to allocate memory for pyramid level %s.\n", name);
+            ok = false;
+        } else if (!save_image(level, name)) {
+            fprintf(stderr, "Saving image to %s failed.\n", name);
+            ok = false;
+        }
+    }
+    if (level != NULL)
+        free_image(level);
+    return ok;
+}
+
+/* Allocate a new struct Image and copy an existing struct Image's contents
+ * into it. On error, returns NULL. 
+ * This function has similar functionality to save_image, but it rather copies 
+ * Image content to another Image struct instead of file. */
+struct Image *copy_image(const struct Image *source)
+{
+    if(source == NULL || !has_bitmap(source)){
+        return NULL;
+    }
+    
+    /* Allocate space for new Image struct with the same width, height, layout and row stride */
+    struct Image *img_copy = new_image(source->width, source->height, source->layout);
+    if (img_copy == NULL) {
+        return NULL; // Memory allocation failed
+    }
+
+    /* Both bitmaps are contiguous with identical stride, padding included */
+    if (source->layout == LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++)
+            memcpy(img_copy->planes[c], source->planes[c], (size_t)source->height * source->stride * sizeof(uint16_t));
+    } else if (img_copy->stride == source->stride) {
+        memcpy(img_copy->pixels, source->pixels, (size_t)source->height * source->stride * sizeof(struct Pixel));
+    } else {
+        for (int i = 0; i < source->height; i++)
+            memcpy(image_row(img_copy, i), image_row(source, i), source->width * sizeof(struct Pixel));
+    }
+    
+    return img_copy;
+}
+
+/* Pick the kernel instruction set: the requested level if the CPU supports it,
+ * otherwise the best one it does. Called once before any image is processed. */
+void resolve_simd(void)
+{
+    enum Simd best = SIMD_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        best = SIMD_SSE2;
+    if (__builtin_cpu_supports("avx2"))
+        best = SIMD_AVX2;
+#endif
+    if (simd == SIMD_AUTO || simd > best)
+        simd = best;
+}
+
+/* Fixed-point reference grey value of a pixel: the weighted sum
+ * 0.299R + 0.587G + 0.114B with 16-bit weights, truncated. Every MONO kernel
+ * produces exactly this value. */
+static inline uint16_t mono_grey(struct Pixel p)
+{
+    return (uint16_t)((MONO_R * (uint32_t)p.red + MONO_G * (uint32_t)p.green + MONO_B * (uint32_t)p.blue) >> 16);
+}
+
+/* Convert n pixels of in to grey into out. in and out may be the same row. */
+void mono_row_scalar(const struct Pixel *in, struct Pixel *out, size_t n)
+{
+    for (size_t j = 0; j < n; j++){
+        uint16_t grey = mono_grey(in[j]);
+        // Set each RGB component to the grey value
+        out[j].red = out[j].green = out[j].blue = grey;
+    }
+}
+
+/* Convert n pixels given as red, green and blue planes to grey, storing the
+ * grey value in each of the output planes. Input and output may coincide. */
+void mono_planes_scalar(const uint16_t *r, const uint16_t *g, const uint16_t *b,
+                        uint16_t *yr, uint16_t *yg, uint16_t *yb, size_t n)
+{
+    for (size_t j = 0; j < n; j++){
+        uint16_t grey = (uint16_t)((MONO_R * (uint32_t)r[j] + MONO_G * (uint32_t)g[j] + MONO_B * (uint32_t)b[j]) >> 16);
+        yr[j] = yg[j] = yb[j] = grey;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* The vector kernels take 8 pixels as three registers of 16-bit samples:
+ *     a0 = R0 G0 B0 R1 G1 B1 R2 G2    a1 = B2 R3 G3 B3 R4 G4 B4 R5    a2 = G5 B5 R6 G6 B6 R7 G7 B7
+ * Masking lanes {0,3,6}, {1,4,7} and {2,5} of each register and merging them
+ * gathers every channel into one register, in the pixel order 0 3 6 1 4 7 2 5
+ * for red; green and blue come out rotated by one and two lanes, which a lane
+ * rotation undoes. The grey values are scattered back the same way in reverse. */
+
+/* Grey value of the 8 pixels in r, g, b (same lane order): 32-bit weighted sums, high halves */
+__attribute__((target("sse2")))
+static inline __m128i mono_grey_sse2(__m128i r, __m128i g, __m128i b)
+{
+    const __m128i wr = _mm_set1_epi16((short)MONO_R);
+    const __m128i wg = _mm_set1_epi16((short)MONO_G);
+    const __m128i wb = _mm_set1_epi16((short)MONO_B);
+
+    __m128i rl = _mm_mullo_epi16(r, wr), rh = _mm_mulhi_epu16(r, wr);
+    __m128i gl = _mm_mullo_epi16(g, wg), gh = _mm_mulhi_epu16(g, wg);
+    __m128i bl = _mm_mullo_epi16(b, wb), bh = _mm_mulhi_epu16(b, wb);
+
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(rl, rh), _mm_unpacklo_epi16(gl, gh)), _mm_unpacklo_epi16(bl, bh));
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(rl, rh), _mm_unpackhi_epi16(gl, gh)), _mm_unpackhi_epi16(bl, bh));
+
+    /* SSE2 only packs with signed saturation, so values are biased into the signed range and back */
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    lo = _mm_sub_epi32(_mm_srli_epi32(lo, 16), bias32);
+    hi = _mm_sub_epi32(_mm_srli_epi32(hi, 16), bias32);
+    return _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16((short)0x8000));
+}
+
+__attribute__((target("sse2")))
+void mono_row_sse2(const struct Pixel *in, struct Pixel *out, size_t n)
+{
+    const __m128i ma = _mm_setr_epi16(-1, 0, 0, -1, 0, 0, -1, 0);
+    const __m128i mb = _mm_setr_epi16(0, -1, 0, 0, -1, 0, 0, -1);
+    const __m128i mc = _mm_setr_epi16(0, 0, -1, 0, 0, -1, 0, 0);
+
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const __m128i *src = (const __m128i *)(in + j);
+        __m128i a0 = _mm_loadu_si128(src);
+        __m128i a1 = _mm_loadu_si128(src + 1);
+        __m128i a2 = _mm_loadu_si128(src + 2);
+
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_and_si128(a0, ma), _mm_and_si128(a1, mb)), _mm_and_si128(a2, mc));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_and_si128(a0, mb), _mm_and_si128(a1, mc)), _mm_and_si128(a2, ma));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_and_si128(a0, mc), _mm_and_si128(a1, ma)), _mm_and_si128(a2, mb));
+        g = _mm_or_si128(_mm_srli_si128(g, 2), _mm_slli_si128(g, 14));
+        b = _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(b, 12));
+
+        __m128i y = mono_grey_sse2(r, g, b);
+        __m128i yg = _mm_or_si128(_mm_slli_si128(y, 2), _mm_srli_si128(y, 14));
+        __m128i yb = _mm_or_si128(_mm_slli_si128(y, 4), _mm_srli_si128(y, 12));
+
+        __m128i *dst = (__m128i *)(out + j);
+        _mm_storeu_si128(dst, _mm_or_si128(_mm_or_si128(_mm_and_si128(y, ma), _mm_and_si128(yg, mb)), _mm_and_si128(yb, mc)));
+        _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_or_si128(_mm_and_si128(y, mb), _mm_and_si128(yg, mc)), _mm_and_si128(yb, ma)));
+        _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_or_si128(_mm_and_si128(y, mc), _mm_and_si128(yg, ma)), _mm_and_si128(yb, mb)));
+    }
+    mono_row_scalar(in + j, out + j, n - j);
+}
+
+/* Grey value of the 16 pixels in r, g, b, as mono_grey_sse2 per 128-bit lane */
+__attribute__((target("avx2")))
+static inline __m256i mono_grey_avx2(__m256i r, __m256i g, __m256i b)
+{
+    const __m256i wr = _mm256_set1_epi16((short)MONO_R);
+    const __m256i wg = _mm256_set1_epi16((short)MONO_G);
+    const __m256i wb = _mm256_set1_epi16((short)MONO_B);
+
+    __m256i rl = _mm256_mullo_epi16(r, wr), rh = _mm256_mulhi_epu16(r, wr);
+    __m256i gl = _mm256_mullo_epi16(g, wg), gh = _mm256_mulhi_epu16(g, wg);
+    __m256i bl = _mm256_mullo_epi16(b, wb), bh = _mm256_mulhi_epu16(b, wb);
+    __m256i sl = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(rl, rh), _mm256_unpacklo_epi16(gl, gh)), _mm256_unpacklo_epi16(bl, bh));
+    __m256i sh = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(rl, rh), _mm256_unpackhi_epi16(gl, gh)), _mm256_unpackhi_epi16(bl, bh));
+    return _mm256_packus_epi32(_mm256_srli_epi32(sl, 16), _mm256_srli_epi32(sh, 16));
+}
+
+/* Same scheme as mono_row_sse2 with two 8-pixel groups side by side, one per
+ * 128-bit lane; every shuffle used stays within its lane. */
+__attribute__((target("avx2")))
+void mono_row_avx2(const struct Pixel *in, struct Pixel *out, size_t n)
+{
+    const __m256i ma = _mm256_setr_epi16(-1, 0, 0, -1, 0, 0, -1, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+    const __m256i mb = _mm256_setr_epi16(0, -1, 0, 0, -1, 0, 0, -1, 0, -1, 0, 0, -1, 0, 0, -1);
+    const __m256i mc = _mm256_setr_epi16(0, 0, -1, 0, 0, -1, 0, 0, 0, 0, -1, 0, 0, -1, 0, 0);
+
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const __m128i *lo = (const __m128i *)(in + j);
+        const __m128i *hi = (const __m128i *)(in + j + 8);
+        __m256i a0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(lo)), _mm_loadu_si128(hi), 1);
+        __m256i a1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(lo + 1)), _mm_loadu_si128(hi + 1), 1);
+        __m256i a2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(lo + 2)), _mm_loadu_si128(hi + 2), 1);
+
+        __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(a0, ma), _mm256_and_si256(a1, mb)), _mm256_and_si256(a2, mc));
+        __m256i g = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(a0, mb), _mm256_and_si256(a1, mc)), _mm256_and_si256(a2, ma));
+        __m256i b = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(a0, mc), _mm256_and_si256(a1, ma)), _mm256_and_si256(a2, mb));
+        g = _mm256_or_si256(_mm256_srli_si256(g, 2), _mm256_slli_si256(g, 14));
+        b = _mm256_or_si256(_mm256_srli_si256(b, 4), _mm256_slli_si256(b, 12));
+
+        __m256i y = mono_grey_avx2(r, g, b);
+
+        __m256i yg = _mm256_or_si256(_mm256_slli_si256(y, 2), _mm256_srli_si256(y, 14));
+        __m256i yb = _mm256_or_si256(_mm256_slli_si256(y, 4), _mm256_srli_si256(y, 12));
+        __m256i o0 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(y, ma), _mm256_and_si256(yg, mb)), _mm256_and_si256(yb, mc));
+        __m256i o1 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(y, mb), _mm256_and_si256(yg, mc)), _mm256_and_si256(yb, ma));
+        __m256i o2 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(y, mc), _mm256_and_si256(yg, ma)), _mm256_and_si256(yb, mb));
+
+        __m128i *dlo = (__m128i *)(out + j);
+        __m128i *dhi = (__m128i *)(out + j + 8);
+        _mm_storeu_si128(dlo, _mm256_castsi256_si128(o0));
+        _mm_storeu_si128(dlo + 1, _mm256_castsi256_si128(o1));
+        _mm_storeu_si128(dlo + 2, _mm256_castsi256_si128(o2));
+        _mm_storeu_si128(dhi, _mm256_extracti128_si256(o0, 1));
+        _mm_storeu_si128(dhi + 1, _mm256_extracti128_si256(o1, 1));
+        _mm_storeu_si128(dhi + 2, _mm256_extracti128_si256(o2, 1));
+    }
+    mono_row_sse2(in + j, out + j, n - j);
+}
+
+/* Planar kernels need no shuffling: each channel is a straight vector load */
+__attribute__((target("sse2")))
+void mono_planes_sse2(const uint16_t *r, const uint16_t *g, const uint16_t *b,
+                      uint16_t *yr, uint16_t *yg, uint16_t *yb, size_t n)
+{
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i y = mono_grey_sse2(_mm_loadu_si128((const __m128i *)(r + j)),
+                                   _mm_loadu_si128((const __m128i *)(g + j)),
+                                   _mm_loadu_si128((const __m128i *)(b + j)));
+        _mm_storeu_si128((__m128i *)(yr + j), y);
+        _mm_storeu_si128((__m128i *)(yg + j), y);
+        _mm_storeu_si128((__m128i *)(yb + j), y);
+    }
+    mono_planes_scalar(r + j, g + j, b + j, yr + j, yg + j, yb + j, n - j);
+}
+
+__attribute__((target("avx2")))
+void mono_planes_avx2(const uint16_t *r, const uint16_t *g, const uint16_t *b,
+                      uint16_t *yr, uint16_t *yg, uint16_t *yb, size_t n)
+{
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i y = mono_grey_avx2(_mm256_loadu_si256((const __m256i *)(r + j)),
+                                   _mm256_loadu_si256((const __m256i *)(g + j)),
+                                   _mm256_loadu_si256((const __m256i *)(b + j)));
+        _mm256_storeu_si256((__m256i *)(yr + j), y);
+        _mm256_storeu_si256((__m256i *)(yg + j), y);
+        _mm256_storeu_si256((__m256i *)(yb + j), y);
+    }
+    mono_planes_sse2(r + j, g + j, b + j, yr + j, yg + j, yb + j, n - j);
+}
+#endif
+
+/* Convert one row of n pixels to grey with the kernel selected by simd */
+void mono_row(const struct Pixel *in, struct Pixel *out, size_t n)
+{
+    switch (simd) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2: mono_row_avx2(in, out, n); return;
+        case SIMD_SSE2: mono_row_sse2(in, out, n); return;
+#endif
+        default: mono_row_scalar(in, out, n); return;
+    }
+}
+
+/* Convert n samples of planes r, g and b to grey into yr, yg and yb with the
+ * best kernel available */
+void mono_plane_rows(const uint16_t *r, const uint16_t *g, const uint16_t *b,
+                     uint16_t *yr, uint16_t *yg, uint16_t *yb, size_t n)
+{
+    switch (simd) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2: mono_planes_avx2(r, g, b, yr, yg, yb, n); return;
+        case SIMD_SSE2: mono_planes_sse2(r, g, b, yr, yg, yb, n); return;
+#endif
+        default: mono_planes_scalar(r, g, b, yr, yg, yb, n); return;
+    }
+}
+
+/* Convert row i of planar source to grey into row i of planar dest */
+void mono_planes(const struct Image *source, struct Image *dest, int i)
+{
+    mono_plane_rows(plane_row(source, 0, i), plane_row(source, 1, i), plane_row(source, 2, i),
+                    plane_row(dest, 0, i), plane_row(dest, 1, i), plane_row(dest, 2, i), source->width);
+}
+
+/* parallel_rows body of apply_MONO: convert rows [row0, row1) of ctx[0] into ctx[1] */
+void mono_band(void *ctx, int row0, int row1)
+{
+    struct Image **images = ctx;
+    for (int i = row0; i < row1; i++)
+        if (images[0]->layout == LAYOUT_PLANAR)
+            mono_planes(images[0], images[1], i);
+        else
+            mono_row(image_row(images[0], i), image_row(images[1], i), images[0]->width);
+}
+
+/* Convert source to monochrome into dest, a caller-provided image of the
+ * same width, height and layout (its row stride may differ). dest may be
+ * source itself. Returns false if either image is missing or they do not match. */
+bool apply_MONO_into(const struct Image *source, struct Image *dest)
+{
+    if (source == NULL || dest == NULL || !has_bitmap(source) || !has_bitmap(dest) ||
+        source->width != dest->width || source->height != dest->height || source->layout != dest->layout)
+        return false;
+
+    /* Iterate through pixel rows and set all colors in each pixel to the calculated grey value,
+     * one band of rows per thread */
+    struct Image *images[2] = {(struct Image *)source, dest};
+    parallel_rows(source->height, mono_band, images);
+    return true;
+}
+
+/* Convert img to monochrome, overwriting its own pixels. Mapped images are
+ * private mappings, so their file is never modified. Returns false on error. */
+bool apply_MONO_in_place(struct Image *img)
+{
+    return apply_MONO_into(img, img);
+}
+
+/* Perform your first task.
+ * Returns a new struct Image containing equal width and height and pixel bit map converted
+ * from colour to monochrome. Each pixel value is converted to the weighted sum of the red, 
+ * green and blue components: 0.299R + 0.587G + 0.114B, computed in 16-bit fixed point
+ * (see mono_grey). The output is written straight into a fresh bitmap; callers that no longer
+ * need the colour image use apply_MONO_in_place instead. On error returns NULL. */
+struct Image *apply_MONO(const struct Image *source)
+{
+    if(source == NULL || !has_bitmap(source)){
+        return NULL;
+    }
+
+    struct Image *mono_image = new_image(source->width, source->height, source->layout);
+    if (mono_image == NULL) {
+        return NULL;
+    }
+
+    apply_MONO_into(source, mono_image);
+    return mono_image;
+}
+
+/* Per-pixel operations accepted by --ops */
+enum OpKind {
+    OP_GRAY,            // gray: MONO
+    OP_GAMMA,           // gamma=G: v^(1/G) on values scaled to [0, 1]
+    OP_BRIGHTNESS,      // brightness=B: v + B, B in [-1, 1]
+    OP_CONTRAST,        // contrast=C: (v - 0.5) * C + 0.5, C >= 0
+    OP_THRESHOLD,       // threshold=T: 1 if v >= T, else 0
+    OP_INVERT,          // invert: 1 - v
+    OP_CLAMP,           // clamp=LO:HI: v limited to [LO, HI]
+    OP_SWAP             // swap=ORDER: channels reordered, e.g. bgr
+};
+
+/* Apply value mapping kind with arguments a and b to every entry of lut,
+ * clamping results to the 16-bit range and rounding them to nearest */
+void op_map_lut(uint16_t *lut, enum OpKind kind, double a, double b)
+{
+    for (int v = 0; v < 65536; v++) {
+        double x = lut[v] / 65535.0;
+        switch (kind) {
+            case OP_GAMMA: x = pow(x, 1.0 / a); break;
+            case OP_BRIGHTNESS: x += a; break;
+            case OP_CONTRAST: x = (x - 0.5) * a + 0.5; break;
+            case OP_THRESHOLD: x = x >= a ? 1.0 : 0.0; break;
+            case OP_INVERT: x = 1.0 - x; break;
+            case OP_CLAMP: x = x < a ? a : x > b ? b : x; break;
+            default: break;
+        }
+        x = x < 0 ? 0 : x > 1 ? 1 : x;
+        lut[v] = (uint16_t)lrint(x * 65535.0);
+    }
+}
+
+/* The map step at the end of chain, appending an identity one unless the
+ * last step already is a map. Returns NULL when the chain is full. */
+struct OpStep *op_map_step(struct OpChain *chain)
+{
+    if (chain->count > 0 && !chain->steps[chain->count - 1].gray)
+        return &chain->steps[chain->count - 1];
+    if (chain->count == OPS_MAX)
+        return NULL;
+    struct OpStep *step = &chain->steps[chain->count++];
+    *step = (struct OpStep){.gray = false, .order = {0, 1, 2}, .lut = NULL};
+    return step;
+}
+
+/* Release the tables of chain and empty it */
+void free_ops(struct OpChain *chain)
+{
+    for (int k = 0; k < chain->count; k++)
+        free(chain->steps[k].lut);
+    chain->count = 0;
+}
+
+/* Compile the comma separated operations of spec, e.g.
+ * "gray,gamma=2.2,contrast=1.2,clamp=0.05:0.95", into chain.
+ * On error, prints a message and returns false. */
+bool parse_ops(const char *spec, struct OpChain *chain)
+{
+    static const char *const names[] = {"gray", "gamma", "brightness", "contrast", "threshold", "invert", "clamp", "swap"};
+
+    char buf[256];
+    if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf)) {
+        fprintf(stderr, "Operation list %s is too long.\n", spec);
+        return false;
+    }
+
+    chain->count = 0;
+    char *save;
+    for (char *token = strtok_r(buf, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        char *arg = strchr(token, '=');
+        if (arg != NULL)
+            *arg++ = '\0';
+
+        int kind = 0;
+        while (kind < (int)(sizeof(names) / sizeof(names[0])) && strcmp(token, names[kind]) != 0)
+            kind++;
+
+        /* Check the argument of each operation */
+        double a = 0, b = 0;
+        char end;
+        bool valid;
+        switch (kind) {
+            case OP_GRAY:
+            case OP_INVERT: valid = arg == NULL; break;
+            case OP_GAMMA: valid = arg != NULL && sscanf(arg, "%lf%c", &a, &end) == 1 && a > 0; break;
+            case OP_BRIGHTNESS: valid = arg != NULL && sscanf(arg, "%lf%c", &a, &end) == 1 && a >= -1 && a <= 1; break;
+            case OP_CONTRAST: valid = arg != NULL && sscanf(arg, "%lf%c", &a, &end) == 1 && a >= 0; break;
+            case OP_THRESHOLD: valid = arg != NULL && sscanf(arg, "%lf%c", &a, &end) == 1 && a >= 0 && a <= 1; break;
+            case OP_CLAMP: valid = arg != NULL && sscanf(arg, "%lf:%lf%c", &a, &b, &end) == 2 && 0 <= a && a <= b && b <= 1; break;
+            case OP_SWAP:
+                valid = arg != NULL && strlen(arg) == 3;
+                for (int c = 0; valid && c < 3; c++)
+                    valid = strchr("rgb", arg[c]) != NULL && strchr(arg + c + 1, arg[c]) == NULL;
+                break;
+            default:
+                fprintf(stderr, "Unknown operation %s.\n", token);
+                free_ops(chain);
+                return false;
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid argument for operation %s.\n", token);
+            free_ops(chain);
+            return false;
+        }
+
+        if (kind == OP_GRAY) {
+            /* Grey values are unchanged by a second conversion */
+            if (chain->count > 0 && chain->steps[chain->count - 1].gray)
+                continue;
+            if (chain->count == OPS_MAX) {
+                fprintf(stderr, "Too many operations in %s.\n", spec);
+                free_ops(chain);
+                return false;
+            }
+            chain->steps[chain->count++] = (struct OpStep){.gray = true};
+            continue;
+        }
+
+        struct OpStep *step = op_map_step(chain);
+        if (step == NULL) {
+            fprintf(stderr, "Too many operations in %s.\n", spec);
+            free_ops(chain);
+            return false;
+        }
+        if (kind == OP_SWAP) {
+            /* The mapping is the same for every channel, so it commutes with
+             * the permutation, which is composed with the step's own */
+            uint8_t order[3];
+            for (int c = 0; c < 3; c++)
+                order[c] = step->order[strchr("rgb", arg[c]) - "rgb"];
+            memcpy(step->order, order, sizeof(order));
+            continue;
+        }
+        if (step->lut == NULL) {
+            step->lut = malloc(65536 * sizeof(uint16_t));
+            if (step->lut == NULL) {
+                fprintf(stderr, "Unable to allocate memory for operation %s.\n", token);
+                free_ops(chain);
+                return false;
+            }
+            for (int v = 0; v < 65536; v++)
+                step->lut[v] = (uint16_t)v;
+        }
+        op_map_lut(step->lut, kind, a, b);
+    }
+    return true;
+}
+
+/* Apply map step to n interleaved pixels. Each pixel is read whole before
+ * it is written, so in may be out. */
+void op_map_row(const struct OpStep *step, const struct Pixel *in, struct Pixel *out, size_t n)
+{
+    const uint16_t *lut = step->lut;
+    for (size_t k = 0; k < n; k++) {
+        uint16_t c[3] = {in[k].red, in[k].green, in[k].blue};
+        uint16_t r = c[step->order[0]], g = c[step->order[1]], b = c[step->order[2]];
+        if (lut != NULL) {
+            r = lut[r];
+            g = lut[g];
+            b = lut[b];
+        }
+        out[k] = (struct Pixel){r, g, b};
+    }
+}
+
+/* Apply map step to n samples of planes in, writing planes out (which may be in) */
+void op_map_planes(const struct OpStep *step, const uint16_t *const in[3], uint16_t *const out[3], size_t n)
+{
+    const uint16_t *lut = step->lut;
+    const uint16_t *r = in[step->order[0]], *g = in[step->order[1]], *b = in[step->order[2]];
+    for (size_t k = 0; k < n; k++) {
+        uint16_t vr = r[k], vg = g[k], vb = b[k];
+        if (lut != NULL) {
+            vr = lut[vr];
+            vg = lut[vg];
+            vb = lut[vb];
+        }
+        out[0][k] = vr;
+        out[1][k] = vg;
+        out[2][k] = vb;
+    }
+}
+
+/* parallel_rows body of apply_ops_into: take rows [row0, row1) of ctx[0]
+ * through every step of op_chain into ctx[1], OPS_CHUNK_PIXELS at a time.
+ * The first step reads the source, later ones work in place on the chunk
+ * just written, which is still in cache. */
+void ops_band(void *ctx, int row0, int row1)
+{
+    struct Image **images = ctx;
+    const struct Image *source = images[0];
+    struct Image *dest = images[1];
+    const struct OpChain *chain = &op_chain;
+
+    for (int i = row0; i < row1; i++)
+        for (int j = 0; j < source->width; j += OPS_CHUNK_PIXELS) {
+            size_t n = source->width - j < OPS_CHUNK_PIXELS ? (size_t)(source->width - j) : OPS_CHUNK_PIXELS;
+            if (source->layout == LAYOUT_PLANAR) {
+                const uint16_t *in[3] = {plane_row(source, 0, i) + j, plane_row(source, 1, i) + j, plane_row(source, 2, i) + j};
+                uint16_t *const out[3] = {plane_row(dest, 0, i) + j, plane_row(dest, 1, i) + j, plane_row(dest, 2, i) + j};
+                for (int k = 0; k < chain->count; k++) {
+                    if (chain->steps[k].gray)
+                        mono_plane_rows(in[0], in[1], in[2], out[0], out[1], out[2], n);
+                    else
+                        op_map_planes(&chain->steps[k], in, out, n);
+                    in[0] = out[0];
+                    in[1] = out[1];
+                    in[2] = out[2];
+                }
+                if (chain->count == 0 && source != dest)
+                    for (int c = 0; c < 3; c++)
+                        memcpy(out[c], in[c], n * sizeof(uint16_t));
+            } else {
+                const struct Pixel *in = image_row(source, i) + j;
+                struct Pixel *out = image_row(dest, i) + j;
+                for (int k = 0; k < chain->count; k++) {
+                    if (chain->steps[k].gray)
+                        mono_row(in, out, n);
+                    else
+                        op_map_row(&chain->steps[k], in, out, n);
+                    in = out;
+                }
+                if (chain->count == 0 && source != dest)
+                    memcpy(out, in, n * sizeof(struct Pixel));
+            }
+        }
+}
+
+/* Apply the operations of op_chain to source, writing dest, which must have
+ * the same width, height and layout and may be source itself. With the
+ * default chain this is exactly apply_MONO_into. Returns false if either
+ * image is missing or they do not match. */
+bool apply_ops_into(const struct Image *source, struct Image *dest)
+{
+    if (source == NULL || dest == NULL || !has_bitmap(source) || !has_bitmap(dest) ||
+        source->width != dest->width || source->height != dest->height || source->layout != dest->layout)
+        return false;
+
+    struct Image *images[2] = {(struct Image *)source, dest};
+    parallel_rows(source->height, ops_band, images);
+    return true;
+}
+
+/* Apply the operations of op_chain to img, overwriting its own pixels.
+ * Returns false on error. */
+bool apply_ops_in_place(struct Image *img)
+{
+    return apply_ops_into(img, img);
+}
+
+/* Sample i of the weighted sum of taps rows: the sum over k of
+ * w[k] * src[k][i] in CONV_SHIFT fixed point, rounded to nearest and clamped
+ * to 16 bits. The weights sum to exactly 1 << CONV_SHIFT; they may be
+ * negative (resampling lobes) as long as their absolute values sum to at
+ * most four times that, which keeps every sum within 32 bits. */
+static inline uint16_t conv_tap_sample(const uint16_t *const *src, const int16_t *w, int taps, size_t i)
+{
+    int32_t acc = 1 << (CONV_SHIFT - 1);
+    for (int k = 0; k < taps; k++)
+        acc += w[k] * src[k][i];
+    acc >>= CONV_SHIFT;
+    return (uint16_t)(acc < 0 ? 0 : acc > 65535 ? 65535 : acc);
+}
+
+/* Reference kernel of the convolution and resampling passes: out[i] is
+ * sample i of the weighted sum of taps rows, for i in [0, n) */
+void conv_taps_scalar(const uint16_t *const *src, const int16_t *w, int taps, uint16_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = conv_tap_sample(src, w, taps, i);
+}
+
+#ifdef HAVE_X86_SIMD
+/* Samples are biased to signed (x - 32768) so that two taps at a time can
+ * be multiplied and added with pmaddwd. As the weights sum to 1 << CONV_SHIFT,
+ * the bias is 32768 << CONV_SHIFT in the sum and is added back with the
+ * rounding term; the saturating pack then clamps exactly as the scalar
+ * kernel does. */
+__attribute__((target("sse2")))
+void conv_taps_sse2(const uint16_t *const *src, const int16_t *w, int taps, uint16_t *out, size_t n)
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i init = _mm_set1_epi32((32768 << CONV_SHIFT) + (1 << (CONV_SHIFT - 1)));
+    const __m128i half = _mm_set1_epi32(32768);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = init, hi = init;
+        for (int k = 0; k < taps; k += 2) {
+            /* An odd last tap is paired with itself at weight 0 */
+            int k1 = k + 1 < taps ? k + 1 : k;
+            __m128i wk = _mm_set1_epi32((int)(((uint32_t)(k + 1 < taps ? (uint16_t)w[k + 1] : 0) << 16) | (uint16_t)w[k]));
+            __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src[k] + i)), bias);
+            __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src[k1] + i)), bias);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+        }
+        /* Back to unsigned 16 bits through a signed pack */
+        lo = _mm_sub_epi32(_mm_srai_epi32(lo, CONV_SHIFT), half);
+        hi = _mm_sub_epi32(_mm_srai_epi32(hi, CONV_SHIFT), half);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi32(lo, hi), bias));
+    }
+    for (; i < n; i++)
+        out[i] = conv_tap_sample(src, w, taps, i);
+}
+
+/* As conv_taps_sse2, 16 samples at a time. The in-lane unpacks and pack
+ * cancel out, so no lane permutation is needed. */
+__attribute__((target("avx2")))
+void conv_taps_avx2(const uint16_t *const *src, const int16_t *w, int taps, uint16_t *out, size_t n)
+{
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i init = _mm256_set1_epi32((32768 << CONV_SHIFT) + (1 << (CONV_SHIFT - 1)));
+    const __m256i half = _mm256_set1_epi32(32768);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = init, hi = init;
+        for (int k = 0; k < taps; k += 2) {
+            int k1 = k + 1 < taps ? k + 1 : k;
+            __m256i wk = _mm256_set1_epi32((int)(((uint32_t)(k + 1 < taps ? (uint16_t)w[k + 1] : 0) << 16) | (uint16_t)w[k]));
+            __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src[k] + i)), bias);
+            __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src[k1] + i)), bias);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wk));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wk));
+        }
+        lo = _mm256_sub_epi32(_mm256_srai_epi32(lo, CONV_SHIFT), half);
+        hi = _mm256_sub_epi32(_mm256_srai_epi32(hi, CONV_SHIFT), half);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_xor_si256(_mm256_packs_epi32(lo, hi), bias));
+    }
+    for (; i < n; i++)
+        out[i] = conv_tap_sample(src, w, taps, i);
+}
+#endif
+
+/* Weighted sum of taps rows of n samples with the kernel selected by simd */
+void conv_taps(const uint16_t *const *src, const int16_t *w, int taps, uint16_t *out, size_t n)
+{
+    switch (simd) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2: conv_taps_avx2(src, w, taps, out, n); return;
+        case SIMD_SSE2: conv_taps_sse2(src, w, taps, out, n); return;
+#endif
+        default: conv_taps_scalar(src, w, taps, out, n); return;
+    }
+}
+
+/* Set the weights of f to a normalised 1-D kernel: g[k] for k in
+ * [-radius, radius], quantised to CONV_SHIFT fixed point with the rounding
+ * error given to the centre so they sum to exactly 1 << CONV_SHIFT */
+void filter_weights(struct Filter *f, int radius, const double *g)
+{
+    double sum = 0;
+    for (int k = 0; k <= 2 * radius; k++)
+        sum += g[k];
+
+    int total = 0;
+    for (int k = 0; k <= 2 * radius; k++) {
+        f->weights[k] = (int16_t)lrint(g[k] / sum * (1 << CONV_SHIFT));
+        total += f->weights[k];
+    }
+    f->weights[radius] += (int16_t)((1 << CONV_SHIFT) - total);
+    f->radius = radius;
+}
+
+/* Parse a --filter spec (box=R, gaussian=SIGMA or sharpen=AMOUNT[:SIGMA])
+ * into f. On error, prints a message and returns false. */
+bool parse_filter(const char *spec, struct Filter *f)
+{
+    double g[2 * CONV_MAX_RADIUS + 1];
+    double sigma = 1.0, amount = 0;
+    int radius;
+    char end;
+
+    *f = (struct Filter){0};
+    if (sscanf(spec, "box=%d%c", &radius, &end) == 1) {
+        if (radius < 1 || radius > CONV_MAX_RADIUS) {
+            fprintf(stderr, "Filter %s needs a radius in [1, %d].\n", spec, CONV_MAX_RADIUS);
+            return false;
+        }
+        for (int k = 0; k <= 2 * radius; k++)
+            g[k] = 1.0;
+        filter_weights(f, radius, g);
+        return true;
+    }
+
+    int fields = sscanf(spec, "sharpen=%lf:%lf%c", &amount, &sigma, &end);
+    bool sharpen = (fields == 1 || fields == 2) && amount > 0 && amount <= 16;
+    if (!sharpen && !(sscanf(spec, "gaussian=%lf%c", &sigma, &end) == 1)) {
+        fprintf(stderr, "Unknown filter %s.\n", spec);
+        return false;
+    }
+    if (!(sigma > 0 && sigma <= CONV_MAX_RADIUS / 3.0)) {
+        fprintf(stderr, "Filter %s needs a sigma in (0, %g].\n", spec, CONV_MAX_RADIUS / 3.0);
+        return false;
+    }
+
+    /* Three sigmas hold all but 0.3% of the Gaussian */
+    radius = (int)ceil(3 * sigma);
+    for (int k = 0; k <= 2 * radius; k++)
+        g[k] = exp(-(double)(k - radius) * (k - radius) / (2 * sigma * sigma));
+    filter_weights(f, radius, g);
+    if (sharpen)
+        f->amount = (int)lrint(amount * 256);
+    return true;
+}
+
+/* Channels held in each sample row of img for the convolution passes:
+ * interleaved rows are width * 3 samples, planar rows one plane each */
+static inline int conv_rows(const struct Image *img)
+{
+    return img->layout == LAYOUT_PLANAR ? 3 : 1;
+}
+
+/* Row i of sample row set c of img, as 16-bit samples */
+static inline uint16_t *conv_row(const struct Image *img, int c, int i)
+{
+    return img->layout == LAYOUT_PLANAR ? plane_row(img, c, i) : (uint16_t *)image_row(img, i);
+}
+
+/* Images of one apply_filter_into call, shared by its row bands */
+struct Convolution {
+    const struct Filter *filter;
+    const struct Image *source;
+    struct Image *tmp;                  // Result of the horizontal pass
+    struct Image *dest;
+};
+
+/* parallel_rows body of the horizontal pass: filter rows [row0, row1) of the
+ * source along x into tmp. Neighbours of a sample are step samples apart (the
+ * other channels lie between them in an interleaved row); the interior uses
+ * the SIMD kernel with shifted row pointers as taps, the edges repeat the
+ * first and last pixel. */
+void conv_h_band(void *ctx, int row0, int row1)
+{
+    const struct Convolution *cv = ctx;
+    const struct Filter *f = cv->filter;
+    int r = f->radius, taps = 2 * r + 1;
+    int step = cv->source->layout == LAYOUT_PLANAR ? 1 : 3;
+    int width = cv->source->width;
+    long len = (long)width * step;
+
+    for (int c = 0; c < conv_rows(cv->source); c++)
+        for (int i = row0; i < row1; i++) {
+            const uint16_t *x = conv_row(cv->source, c, i);
+            uint16_t *out = conv_row(cv->tmp, c, i);
+
+            long interior0 = (long)r * step, interior1 = len - (long)r * step;
+            if (interior1 > interior0) {
+                const uint16_t *src[2 * CONV_MAX_RADIUS + 1];
+                for (int k = 0; k < taps; k++)
+                    src[k] = x + (long)k * step;
+                conv_taps(src, f->weights, taps, out + interior0, (size_t)(interior1 - interior0));
+            } else {
+                interior0 = interior1 = len;
+            }
+
+            /* Edge samples, clamping neighbours to the row */
+            for (long s = 0; s < len; s++) {
+                if (s == interior0)
+                    s = interior1;
+                if (s >= len)
+                    break;
+                long j = s / step, ch = s % step;
+                int32_t acc = 1 << (CONV_SHIFT - 1);
+                for (int k = 0; k < taps; k++) {
+                    long jj = j + k - r;
+                    jj = jj < 0 ? 0 : jj >= width ? width - 1 : jj;
+                    acc += f->weights[k] * x[jj * step + ch];
+                }
+                out[s] = (uint16_t)(acc >> CONV_SHIFT);
+            }
+        }
+}
+
+/* parallel_rows body of the vertical pass: filter rows [row0, row1) of tmp
+ * along y into dest, CONV_BLOCK_SAMPLES columns at a time so the rows
+ * feeding consecutive output rows stay in cache. For sharpening, the blurred
+ * block is combined with the source sample it replaces. */
+void conv_v_band(void *ctx, int row0, int row1)
+{
+    const struct Convolution *cv = ctx;
+    const struct Filter *f = cv->filter;
+    int r = f->radius, taps = 2 * r + 1;
+    int height = cv->tmp->height;
+    size_t len = (size_t)cv->tmp->width * (cv->tmp->layout == LAYOUT_PLANAR ? 1 : 3);
+    uint16_t blur[CONV_BLOCK_SAMPLES];
+
+    for (int c = 0; c < conv_rows(cv->tmp); c++)
+        for (size_t j0 = 0; j0 < len; j0 += CONV_BLOCK_SAMPLES) {
+            size_t n = len - j0 < CONV_BLOCK_SAMPLES ? len - j0 : CONV_BLOCK_SAMPLES;
+            for (int i = row0; i < row1; i++) {
+                const uint16_t *src[2 * CONV_MAX_RADIUS + 1];
+                for (int k = 0; k < taps; k++) {
+                    int ii = i + k - r;
+                    ii = ii < 0 ? 0 : ii >= height ? height - 1 : ii;
+                    src[k] = conv_row(cv->tmp, c, ii) + j0;
+                }
+
+                uint16_t *out = conv_row(cv->dest, c, i) + j0;
+                if (f->amount == 0) {
+                    conv_taps(src, f->weights, taps, out, n);
+                    continue;
+                }
+
+                /* Unsharp mask: x + amount * (x - blur), from the source sample */
+                const uint16_t *x = conv_row(cv->source, c, i) + j0;
+                conv_taps(src, f->weights, taps, blur, n);
+                for (size_t k = 0; k < n; k++) {
+                    int32_t v = x[k] + (((x[k] - blur[k]) * f->amount + 128) >> 8);
+                    out[k] = (uint16_t)(v < 0 ? 0 : v > 65535 ? 65535 : v);
+                }
+            }
+        }
+}
+
+/* Filter source with the separable kernel f into dest, which must have the
+ * same width, height and layout and may be source itself: a horizontal pass
+ * into a temporary image, then a vertical pass back, each over bands of rows
+ * on the thread pool. Returns false on error. */
+bool apply_filter_into(const struct Filter *f, const struct Image *source, struct Image *dest)
+{
+    if (source == NULL || dest == NULL || !has_bitmap(source) || !has_bitmap(dest) ||
+        source->width != dest->width || source->height != dest->height || source->layout != dest->layout)
+        return false;
+    if (f->radius == 0) {
+        if (source != dest)
+            for (int c = 0; c < conv_rows(source); c++)
+                for (int i = 0; i < source->height; i++)
+                    memcpy(conv_row(dest, c, i), conv_row(source, c, i),
+                           (size_t)source->width * (source->layout == LAYOUT_PLANAR ? 1 : 3) * sizeof(uint16_t));
+        return true;
+    }
+
+    struct Image *tmp = new_image(source->width, source->height, source->layout);
+    if (tmp == NULL)
+        return false;
+
+    struct Convolution cv = {.filter = f, .source = source, .tmp = tmp, .dest = dest};
+    parallel_rows(source->height, conv_h_band, &cv);
+    parallel_rows(source->height, conv_v_band, &cv);
+    free_image(tmp);
+    return true;
+}
+
+/* Filter img in place with the --filter kernel. Returns false on error. */
+bool apply_filter_in_place(struct Image *img)
+{
+    return apply_filter_into(&image_filter, img, img);
+}
+
+/* Apply the transform stage to img in place: the --ops chain (MONO by
+ * default), then the --filter kernel if any. Returns false on error. */
+bool transform_in_place(struct Image *img)
+{
+    return apply_ops_in_place(img) && apply_filter_in_place(img);
+}
+
+/* Value of the continuous kernel of method at distance x from a sample */
+double resample_kernel(enum ResampleMethod method, double x)
+{
+    switch (method) {
+        case RESAMPLE_BOX: return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+        case RESAMPLE_BILINEAR: return fabs(x) < 1.0 ? 1.0 - fabs(x) : 0.0;
+        case RESAMPLE_LANCZOS:
+            if (x == 0)
+                return 1.0;
+            if (fabs(x) >= 3.0)
+                return 0.0;
+            return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+    }
+    return 0.0;
+}
+
+/* Release the tables of a */
+void free_axis(struct ResampleAxis *a)
+{
+    free(a->first);
+    free(a->count);
+    free(a->weights);
+}
+
+/* Build the tables resampling in_len samples to out_len along one axis. When
+ * downscaling the kernel is stretched by the scale, so every source sample
+ * contributes to the output. Weights are quantised to CONV_SHIFT fixed point
+ * with the rounding error given to the largest, so each output's weights sum
+ * to exactly 1 << CONV_SHIFT. Returns false when out of memory. */
+bool resample_axis(struct ResampleAxis *a, int in_len, int out_len, enum ResampleMethod method)
+{
+    static const double support[] = {[RESAMPLE_BOX] = 0.5, [RESAMPLE_BILINEAR] = 1.0, [RESAMPLE_LANCZOS] = 3.0};
+    double scale = (double)in_len / out_len;
+    double stretch = scale > 1 ? scale : 1;
+    double reach = support[method] * stretch;
+
+    a->taps_max = 2 * (int)ceil(reach) + 1;
+    a->first = malloc((size_t)out_len * sizeof(int));
+    a->count = malloc((size_t)out_len * sizeof(int));
+    a->weights = malloc((size_t)out_len * a->taps_max * sizeof(int16_t));
+    double *g = malloc((size_t)a->taps_max * sizeof(double));
+    if (a->first == NULL || a->count == NULL || a->weights == NULL || g == NULL) {
+        free_axis(a);
+        free(g);
+        return false;
+    }
+
+    for (int i = 0; i < out_len; i++) {
+        double center = (i + 0.5) * scale;
+        int x0 = (int)floor(center - reach + 0.5), x1 = (int)floor(center + reach + 0.5);
+        x0 = x0 < 0 ? 0 : x0;
+        x1 = x1 > in_len ? in_len : x1;
+        if (x1 - x0 > a->taps_max)
+            x1 = x0 + a->taps_max;
+
+        double sum = 0;
+        for (int k = 0; k < x1 - x0; k++)
+            sum += g[k] = resample_kernel(method, (x0 + k + 0.5 - center) / stretch);
+        if (x1 <= x0 || sum == 0) {
+            /* Nothing in reach: take the nearest sample */
+            x0 = (int)center < in_len ? (int)center : in_len - 1;
+            x1 = x0 + 1;
+            g[0] = sum = 1.0;
+        }
+
+        int16_t *w = a->weights + (size_t)i * a->taps_max;
+        int total = 0, largest = 0;
+        for (int k = 0; k < x1 - x0; k++) {
+            w[k] = (int16_t)lrint(g[k] / sum * (1 << CONV_SHIFT));
+            total += w[k];
+            if (w[k] > w[largest])
+                largest = k;
+        }
+        w[largest] += (int16_t)((1 << CONV_SHIFT) - total);
+        a->first[i] = x0;
+        a->count[i] = x1 - x0;
+    }
+
+    free(g);
+    return true;
+}
+
+/* Resample one row along x with the tables of a: out_len outputs from a row
+ * whose neighbouring samples are step apart (3 in an interleaved row, where
+ * each channel is resampled separately) */
+void resample_row(const struct ResampleAxis *a, const uint16_t *in, uint16_t *out, int out_len, int step)
+{
+    for (int j = 0; j < out_len; j++) {
+        const int16_t *w = a->weights + (size_t)j * a->taps_max;
+        const uint16_t *p = in + (size_t)a->first[j] * step;
+        for (int c = 0; c < step; c++) {
+            int32_t acc = 1 << (CONV_SHIFT - 1);
+            for (int k = 0; k < a->count[j]; k++)
+                acc += w[k] * p[k * step + c];
+            acc >>= CONV_SHIFT;
+            out[(size_t)j * step + c] = (uint16_t)(acc < 0 ? 0 : acc > 65535 ? 65535 : acc);
+        }
+    }
+}
+
+/* Images and tables of one apply_resize call, shared by its row bands */
+struct Resize {
+    const struct Image *source;
+    struct Image *tmp;                  // Source height, output width: result of the x pass
+    struct Image *dest;
+    struct ResampleAxis x, y;
+};
+
+/* parallel_rows body of the x pass: resample source rows [row0, row1) into tmp */
+void resize_x_band(void *ctx, int row0, int row1)
+{
+    const struct Resize *rz = ctx;
+    int step = rz->source->layout == LAYOUT_PLANAR ? 1 : 3;
+    for (int c = 0; c < conv_rows(rz->source); c++)
+        for (int i = row0; i < row1; i++)
+            resample_row(&rz->x, conv_row(rz->source, c, i), conv_row(rz->tmp, c, i), rz->tmp->width, step);
+}
+
+/* parallel_rows body of the y pass: each output row in [row0, row1) is a
+ * weighted sum of whole tmp rows, computed with the vectorised convolution
+ * kernel */
+void resize_y_band(void *ctx, int row0, int row1)
+{
+    const struct Resize *rz = ctx;
+    const uint16_t *src[rz->y.taps_max];
+    size_t len = (size_t)rz->dest->width * (rz->dest->layout == LAYOUT_PLANAR ? 1 : 3);
+    for (int c = 0; c < conv_rows(rz->dest); c++)
+        for (int i = row0; i < row1; i++) {
+            for (int k = 0; k < rz->y.count[i]; k++)
+                src[k] = conv_row(rz->tmp, c, rz->y.first[i] + k);
+            conv_taps(src, rz->y.weights + (size_t)i * rz->y.taps_max, rz->y.count[i], conv_row(rz->dest, c, i), len);
+        }
+}
+
+/* The output dimensions of resizing a width x height image to resize_width x
+ * resize_height, where a zero dimension follows the aspect ratio */
+void resize_dimensions(int width, int height, int *out_width, int *out_height)
+{
+    *out_width = resize_width;
+    *out_height = resize_height;
+    if (*out_width == 0)
+        *out_width = (int)lrint((double)width * *out_height / height);
+    if (*out_height == 0)
+        *out_height = (int)lrint((double)height * *out_width / width);
+    *out_width = *out_width < 1 ? 1 : *out_width;
+    *out_height = *out_height < 1 ? 1 : *out_height;
+}
+
+/* Return a new image of source resampled to width x height with method, in
+ * the same layout: a pass along x into a temporary image of the source's
+ * height, then a pass along y, both over bands of rows on the thread pool.
+ * On error returns NULL. */
+struct Image *apply_resize(const struct Image *source, int width, int height, enum ResampleMethod method)
+{
+    if (source == NULL || !has_bitmap(source) || width <= 0 || height <= 0)
+        return NULL;
+
+    struct Resize rz = {.source = source};
+    if (!resample_axis(&rz.x, source->width, width, method))
+        return NULL;
+    if (!resample_axis(&rz.y, source->height, height, method)) {
+        free_axis(&rz.x);
+        return NULL;
+    }
+
+    rz.tmp = new_image(width, source->height, source->layout);
+    rz.dest = new_image(width, height, source->layout);
+    if (rz.tmp != NULL && rz.dest != NULL) {
+        parallel_rows(source->height, resize_x_band, &rz);
+        parallel_rows(height, resize_y_band, &rz);
+    } else if (rz.dest != NULL) {
+        free_image(rz.dest);
+        rz.dest = NULL;
+    }
+
+    if (rz.tmp != NULL)
+        free_image(rz.tmp);
+    free_axis(&rz.x);
+    free_axis(&rz.y);
+    return rz.dest;
+}
+
+/* Release everything held by rs */
+void resampler_free(struct Resampler *rs)
+{
+    free_axis(&rs->x);
+    free_axis(&rs->y);
+    free(rs->ring);
+    free(rs->row);
+    free(rs->taps);
+    rs->ring = NULL;
+    rs->row = NULL;
+    rs->taps = NULL;
+}
+
+/* Prepare rs to resample a stream of in_width x in_height interleaved rows
+ * to out_width x out_height with method. Returns false when out of memory. */
+bool resampler_init(struct Resampler *rs, int in_width, int in_height, int out_width, int out_height,
+                    enum ResampleMethod method)
+{
+    *rs = (struct Resampler){.in_width = in_width, .in_height = in_height,
+                             .out_width = out_width, .out_height = out_height};
+    if (!resample_axis(&rs->x, in_width, out_width, method))
+        return false;
+    if (!resample_axis(&rs->y, in_height, out_height, method)) {
+        free_axis(&rs->x);
+        return false;
+    }
+
+    size_t row_samples = (size_t)out_width * 3;
+    rs->ring = malloc((size_t)rs->y.taps_max * row_samples * sizeof(uint16_t));
+    rs->row = malloc(row_samples * sizeof(uint16_t));
+    rs->taps = malloc((size_t)rs->y.taps_max * sizeof *rs->taps);
+    if (rs->ring == NULL || rs->row == NULL || rs->taps == NULL) {
+        resampler_free(rs);
+        return false;
+    }
+    return true;
+}
+
+/* Resample the next input row along x into the ring of rs */
+void resampler_push(struct Resampler *rs, const struct Pixel *row)
+{
+    size_t row_samples = (size_t)rs->out_width * 3;
+    uint16_t *slot = rs->ring + (size_t)(rs->pushed % rs->y.taps_max) * row_samples;
+    resample_row(&rs->x, (const uint16_t *)row, slot, rs->out_width, 3);
+    rs->pushed++;
+}
+
+/* The next output row, once every input row it depends on has been pushed,
+ * else NULL. Must be called until it returns NULL after each push: the ring
+ * only holds the last y.taps_max rows. The row stays valid until the next call. */
+const struct Pixel *resampler_next(struct Resampler *rs)
+{
+    int i = rs->emitted;
+    if (i >= rs->out_height || rs->y.first[i] + rs->y.count[i] > rs->pushed)
+        return NULL;
+
+    size_t row_samples = (size_t)rs->out_width * 3;
+    for (int k = 0; k < rs->y.count[i]; k++)
+        rs->taps[k] = rs->ring + (size_t)((rs->y.first[i] + k) % rs->y.taps_max) * row_samples;
+    conv_taps(rs->taps, rs->y.weights + (size_t)i * rs->y.taps_max, rs->y.count[i], rs->row, row_samples);
+    rs->emitted++;
+    return (const struct Pixel *)rs->row;
+}
+
+/* Parse a --resize spec, WIDTHxHEIGHT[:METHOD], into resize_width,
+ * resize_height and resize_method. On error, prints a message and returns false. */
+bool parse_resize(const char *spec)
+{
+    static const char *const methods[] = {[RESAMPLE_BOX] = "box", [RESAMPLE_BILINEAR] = "bilinear", [RESAMPLE_LANCZOS] = "lanczos"};
+    int width, height, used = 0;
+    if (sscanf(spec, "%dx%d%n", &width, &height, &used) != 2 || width < 0 || height < 0 ||
+        (width == 0 && height == 0)) {
+        fprintf(stderr, "Invalid size %s, expected WIDTHxHEIGHT.\n", spec);
+        return false;
+    }
+
+    enum ResampleMethod method = RESAMPLE_LANCZOS;
+    if (spec[used] == ':') {
+        int m = 0;
+        while (m < 3 && strcmp(spec + used + 1, methods[m]) != 0)
+            m++;
+        if (m == 3) {
+            fprintf(stderr, "Unknown resampling method %s.\n", spec + used + 1);
+            return false;
+        }
+        method = (enum ResampleMethod)m;
+    } else if (spec[used] != '\0') {
+        fprintf(stderr, "Invalid size %s, expected WIDTHxHEIGHT.\n", spec);
+        return false;
+    }
+
+    resize_width = width;
+    resize_height = height;
+    resize_method = method;
+    return true;
+}
+
+/* Parse a --tile spec, WIDTHxHEIGHT or NULL for the default, into
+ * tile_width and tile_height. On error, prints a message and returns false. */
+bool parse_tile(const char *spec)
+{
+    int width = TILE_SIZE, height = TILE_SIZE;
+    char end;
+    if (spec != NULL && (sscanf(spec, "%dx%d%c", &width, &height, &end) != 2 || width <= 0 || height <= 0)) {
+        fprintf(stderr, "Invalid tile size %s, expected WIDTHxHEIGHT.\n", spec);
+        return false;
+    }
+    tile_width = width;
+    tile_height = height;
+    return true;
+}
+
+/* Parse a --pyramid spec, a number of levels or NULL for PYRAMID_AUTO, into
+ * pyramid_levels. On error, prints a message and returns false. */
+bool parse_pyramid(const char *spec)
+{
+    int levels = PYRAMID_AUTO;
+    char end;
+    if (spec != NULL && (sscanf(spec, "%d%c", &levels, &end) != 1 || levels < 1 || levels > PYRAMID_MAX)) {
+        fprintf(stderr, "Invalid number of pyramid levels %s, expected 1 to %d.\n", spec, PYRAMID_MAX);
+        return false;
+    }
+    pyramid_levels = levels;
+    return true;
+}
+
+/* Take dir as the --cache directory, if the names of its entries, up to 64
+ * characters longer, still fit in MAX_FILENAME. On error, prints a message
+ * and returns false. */
+bool parse_cache(const char *dir)
+{
+    if (*dir == '\0' || strlen(dir) > MAX_FILENAME - 64) {
+        fprintf(stderr, "Invalid cache directory %s, expected a name of 1 to %d characters.\n", dir, MAX_FILENAME - 64);
+        return false;
+    }
+    cache_dir = dir;
+    return true;
+}
+
+/* Parse an --async spec, a queue depth or NULL for AIO_DEPTH, into
+ * async_depth. On error, prints a message and returns false. */
+bool parse_async(const char *spec)
+{
+    int depth = AIO_DEPTH;
+    char end;
+    if (spec != NULL && (sscanf(spec, "%d%c", &depth, &end) != 1 || depth < 2 || depth > AIO_DEPTH_MAX)) {
+        fprintf(stderr, "Invalid async queue depth %s, expected 2 to %d.\n", spec, AIO_DEPTH_MAX);
+        return false;
+    }
+    async_depth = depth;
+    return true;
+}
+
+/* Parse a --region spec, WIDTHxHEIGHT+X+Y, into region. On error, prints
+ * a message and returns false. */
+bool parse_region(const char *spec)
+{
+    struct Region r;
+    char end;
+    if (sscanf(spec, "%dx%d+%d+%d%c", &r.width, &r.height, &r.x, &r.y, &end) != 4 ||
+        r.width <= 0 || r.height <= 0 || r.x < 0 || r.y < 0) {
+        fprintf(stderr, "Invalid region %s, expected WIDTHxHEIGHT+X+Y.\n", spec);
+        return false;
+    }
+    region = r;
+    return true;
+}
+
+/* Apply the transform stage to img: transform_in_place, then --resize if
+ * given, which replaces img with a new image. Returns the result, or NULL on
+ * error, in which case img has been freed. */
+struct Image *transform_image(struct Image *img)
+{
+    if (!transform_in_place(img)) {
+        free_image(img);
+        return NULL;
+    }
+    if (resize_width == 0 && resize_height == 0)
+        return img;
+
+    int width, height;
+    resize_dimensions(img->width, img->height, &width, &height);
+    struct Image *resized = apply_resize(img, width, height, resize_method);
+    free_image(img);
+    return resized;
+}
+
+/* Transform 16-bit integers into 8-bit representation to fit RGB range of 0-255.
+ * color * 255 / 65535 is color / 257, and for every 16-bit color that equals
+ * (color * 65281) >> 24 exactly, so no division is needed. */
+uint8_t eightBits(uint16_t color){
+
+    uint8_t reduced = (uint8_t)((color * 65281u) >> 24);
+    return reduced;
+
+}
+
+/* As eightBits, but rounded to the nearest 8-bit value: (color + 128) / 257,
+ * again exact for every 16-bit color as a multiply and shift. */
+uint8_t eightBitsNearest(uint16_t color){
+
+    return (uint8_t)(((color + 128u) * 65281u) >> 24);
+
+}
+
+void reduce_row_scalar(const uint16_t *in, uint8_t *out, size_t n, enum Reduce mode)
+{
+    if (mode == REDUCE_NEAREST)
+        for (size_t j = 0; j < n; j++)
+            out[j] = eightBitsNearest(in[j]);
+    else
+        for (size_t j = 0; j < n; j++)
+            out[j] = eightBits(in[j]);
+}
+
+#ifdef HAVE_X86_SIMD
+/* The vector reductions compute the high half of color * 65281 with an
+ * unsigned high multiply and shift it by the remaining 8 bits. Adding 128 for
+ * rounding saturates, which is harmless: every color from 65407 up reduces
+ * to 255 either way. */
+__attribute__((target("sse2")))
+void reduce_row_sse2(const uint16_t *in, uint8_t *out, size_t n, enum Reduce mode)
+{
+    const __m128i mul = _mm_set1_epi16((short)65281);
+    const __m128i half = _mm_set1_epi16(mode == REDUCE_NEAREST ? 128 : 0);
+
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m128i a = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(in + j)), half);
+        __m128i b = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(in + j + 8)), half);
+        a = _mm_srli_epi16(_mm_mulhi_epu16(a, mul), 8);
+        b = _mm_srli_epi16(_mm_mulhi_epu16(b, mul), 8);
+        _mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(a, b));
+    }
+    reduce_row_scalar(in + j, out + j, n - j, mode);
+}
+
+__attribute__((target("avx2")))
+void reduce_row_avx2(const uint16_t *in, uint8_t *out, size_t n, enum Reduce mode)
+{
+    const __m256i mul = _mm256_set1_epi16((short)65281);
+    const __m256i half = _mm256_set1_epi16(mode == REDUCE_NEAREST ? 128 : 0);
+
+    size_t j = 0;
+    for (; j + 32 <= n; j += 32) {
+        __m256i a = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(in + j)), half);
+        __m256i b = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(in + j + 16)), half);
+        a = _mm256_srli_epi16(_mm256_mulhi_epu16(a, mul), 8);
+        b = _mm256_srli_epi16(_mm256_mulhi_epu16(b, mul), 8);
+        /* packus works within 128-bit lanes; restore the sample order across them */
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(out + j), packed);
+    }
+    reduce_row_sse2(in + j, out + j, n - j, mode);
+}
+#endif
+
+/* Reduce n 16-bit samples to 8 bits with the given rounding, using the kernel
+ * selected by simd. Works on any run of samples: a plane row, or an
+ * interleaved row seen as 3 * width samples. */
+void reduce_row(const uint16_t *in, uint8_t *out, size_t n, enum Reduce mode)
+{
+    switch (simd) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2: reduce_row_avx2(in, out, n, mode); return;
+        case SIMD_SSE2: reduce_row_sse2(in, out, n, mode); return;
+#endif
+        default: reduce_row_scalar(in, out, n, mode); return;
+    }
+}
+
+/* Decimal text of every 8-bit value, NUL padded to 4 bytes so it can be
+ * copied with one fixed-size memcpy, and its length. */
+char code_digits[256][4];
+uint8_t code_digits_len[256];
+pthread_once_t code_digits_once = PTHREAD_ONCE_INIT;
+
+void code_init_digits(void)
+{
+    for (int v = 0; v < 256; v++)
+        code_digits_len[v] = (uint8_t)snprintf(code_digits[v], sizeof(code_digits[v]), "%d", v);
+}
+
+/* Hand the collected text of cw to its stream */
+void code_flush(struct CodeWriter *cw)
+{
+    fwrite(cw->buf, 1, cw->used, cw->out);
+    counters.bytes_written += cw->used;
+    if (cw->copy != NULL) {
+        fwrite(cw->buf, 1, cw->used, cw->copy);
+        counters.bytes_written += cw->used;
+    }
+    cw->used = 0;
+}
+
+/* Print the declarations opening the C source of a width x height image
+ * and start the first line of pixel data in cw. */
+void code_begin(struct CodeWriter *cw, FILE *out, int width, int height)
+{
+    pthread_once(&code_digits_once, code_init_digits);
+
+    cw->out = out;
+    cw->copy = NULL;
+    cw->count = 0;
+    cw->used = (size_t)snprintf(cw->buf, sizeof(cw->buf),
+                                "const int image_width = %d;\n"
+                                "const int image_height = %d;\n"
+                                "const struct Pixel image_data[%d][%d] = {\n"
+                                "    ",     /* Each line starts with whitespace to represent indentation */
+                                width, height, height, width);
+    cw->line_len = 4;
+}
+
+/* Append one pixel, given as 8-bit channels, to the C source as "{r, g, b}".
+ * The ", " separating it from the previous pixel is only written now, so the
+ * last pixel never gets one; a line is ended when "{r, g, b}, " would take it
+ * past CODE_LINE_MAX characters. */
+static inline void code_emit(struct CodeWriter *cw, uint8_t r, uint8_t g, uint8_t b)
+{
+    size_t len = 8 + code_digits_len[r] + code_digits_len[g] + code_digits_len[b];
+
+    /* Room for the separator, a new line and the pixel, plus the over-copy of the last digits */
+    if (cw->used + 32 > sizeof(cw->buf))
+        code_flush(cw);
+
+    char *o = cw->buf + cw->used;
+    if (cw->count > 0) {
+        *o++ = ',';
+        *o++ = ' ';
+        // Check if adding the pixel to line would exceed maximum line size 
+        if (cw->line_len + len > CODE_LINE_MAX) {
+            memcpy(o, "\n    ", 5);  // Start a new line with indentation
+            o += 5;
+            cw->line_len = 4;
+        }
+    }
+
+    *o++ = '{';
+    memcpy(o, code_digits[r], 4);
+    o += code_digits_len[r];
+    *o++ = ',';
+    *o++ = ' ';
+    memcpy(o, code_digits[g], 4);
+    o += code_digits_len[g];
+    *o++ = ',';
+    *o++ = ' ';
+    memcpy(o, code_digits[b], 4);
+    o += code_digits_len[b];
+    *o++ = '}';
+
+    cw->used = (size_t)(o - cw->buf);
+    cw->line_len += len;
+    cw->count++;
+}
+
+/* Append n consecutive interleaved pixels to the C source, reducing them to
+ * 8 bits CODE_ROW_PIXELS at a time */
+void code_row(struct CodeWriter *cw, const struct Pixel *p, size_t n)
+{
+    uint8_t b8[3 * CODE_ROW_PIXELS];
+    for (size_t j = 0; j < n; j += CODE_ROW_PIXELS) {
+        size_t m = n - j < CODE_ROW_PIXELS ? n - j : CODE_ROW_PIXELS;
+        reduce_row((const uint16_t *)(p + j), b8, 3 * m, code_reduce);
+        for (size_t k = 0; k < m; k++)
+            code_emit(cw, b8[3 * k], b8[3 * k + 1], b8[3 * k + 2]);
+    }
+}
+
+/* Append n pixels given as red, green and blue plane rows to the C source */
+void code_planes(struct CodeWriter *cw, const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n)
+{
+    uint8_t b8[3][CODE_ROW_PIXELS];
+    for (size_t j = 0; j < n; j += CODE_ROW_PIXELS) {
+        size_t m = n - j < CODE_ROW_PIXELS ? n - j : CODE_ROW_PIXELS;
+        reduce_row(r + j, b8[0], m, code_reduce);
+        reduce_row(g + j, b8[1], m, code_reduce);
+        reduce_row(b + j, b8[2], m, code_reduce);
+        for (size_t k = 0; k < m; k++)
+            code_emit(cw, b8[0][k], b8[1][k], b8[2][k]);
+    }
+}
+
+/* Print the last line of pixel data and close the array */
+void code_end(struct CodeWriter *cw)
+{
+    if (cw->used + 8 > sizeof(cw->buf))
+        code_flush(cw);
+
+    /* Without pixels the indentation loses its last two characters, as the
+     * trailing comma would */
+    if (cw->count == 0)
+        cw->used -= 2;
+    memcpy(cw->buf + cw->used, "\n};\n", 4);
+    cw->used += 4;
+    code_flush(cw);
+}
+
+/* Print the dimensions and pixel data of source as C source code to stdout,
+ * also writing the text to copy unless it is NULL. Returns false on error. */
+bool code_image(const struct Image *source, FILE *copy)
+{
+    if(source == NULL || !has_bitmap(source)){
+        return false;
+    }
+
+    struct CodeWriter cw;
+    code_begin(&cw, stdout, source->width, source->height);
+    cw.copy = copy;
+
+    for (int i = 0; i < source->height; i++)
+        if (source->layout == LAYOUT_PLANAR)
+            code_planes(&cw, plane_row(source, 0, i), plane_row(source, 1, i), plane_row(source, 2, i), source->width);
+        else
+            code_row(&cw, image_row(source, i), source->width);
+
+    code_end(&cw);
+    return true;
+}
+
+/* Perform your second task.
+ * Function accepts an Image struct, printing it's dimensions and pixel data as C source code.
+ * Returns false on error. */
+bool apply_CODE(const struct Image *source)
+{
+    return code_image(source, NULL);
+}
+
+void queue_init(struct Queue *q)
+{
+    q->head = q->count = 0;
+    q->closed = q->cancelled = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+/* Free the images still queued in q and its synchronisation objects */
+void queue_destroy(struct Queue *q)
+{
+    for (int k = 0; k < q->count; k++)
+        if (q->items[(q->head + k) % QUEUE_DEPTH].img != NULL)
+            free_image(q->items[(q->head + k) % QUEUE_DEPTH].img);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/* Append item to q, waiting for room. Returns false, without taking
+ * ownership of item.img, if the consumer has cancelled the queue. */
+bool queue_push(struct Queue *q, struct QueueItem item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == QUEUE_DEPTH && !q->cancelled)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    bool ok = !q->cancelled;
+    if (ok) {
+        q->items[(q->head + q->count) % QUEUE_DEPTH] = item;
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/* Take the oldest item of q into *item, waiting for one. Returns false once
+ * q is closed and empty, or cancelled. */
+bool queue_pop(struct Queue *q, struct QueueItem *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed && !q->cancelled)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    bool ok = q->count > 0 && !q->cancelled;
+    if (ok) {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % QUEUE_DEPTH;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/* Producer side: no more items will be pushed */
+void queue_close(struct Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Consumer side: stop accepting items and wake a blocked producer */
+void queue_cancel(struct Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->cancelled = true;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* State shared by the stages of process_pipelined */
+struct Pipeline {
+    struct Batch *batch;
+    struct Queue loaded;                // Reader to transform stage
+    struct Queue converted;             // Transform to writer stage
+};
+
+/* Reader stage: load every input in order. A failed load is passed on as a
+ * NULL image so the writer stops at the right place. */
+void *pipeline_reader(void *arg)
+{
+    struct Pipeline *pl = arg;
+    for (int i = 0; i < pl->batch->count; i++) {
+        struct Job *job = &pl->batch->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        struct QueueItem item = {i, load_job(job)};
+        stage_end(&probe, job, STAGE_LOAD);
+        if (!queue_push(&pl->loaded, item)) {
+            if (item.img != NULL)
+                free_image(item.img);
+            break;
+        }
+        if (item.img == NULL)
+            break;
+    }
+    queue_close(&pl->loaded);
+    return NULL;
+}
+
+/* Transform stage: apply the --ops chain (MONO by default), --filter and
+ * --resize to each loaded image. */
+void *pipeline_transform(void *arg)
+{
+    struct Pipeline *pl = arg;
+    struct QueueItem item;
+    while (queue_pop(&pl->loaded, &item)) {
+        struct Job *job = &pl->batch->jobs[item.index];
+        if (item.img != NULL) {
+            struct StageProbe probe;
+            stage_begin(&probe);
+            item.img = transform_image(item.img);
+            stage_end(&probe, job, STAGE_MONO);
+            if (item.img == NULL)
+                fprintf(stderr, "First process failed for file %s.\n", job->input);
+        }
+        if (!queue_push(&pl->converted, item)) {
+            if (item.img != NULL)
+                free_image(item.img);
+            break;
+        }
+        if (item.img == NULL)
+            break;
+    }
+    queue_cancel(&pl->loaded);
+    queue_close(&pl->converted);
+    return NULL;
+}
+
+/* Process the jobs of b like main does, but as three concurrent stages
+ * joined by bounded queues: while image i is being printed and saved on this
+ * thread, image i+1 is converted and image i+2 loaded. At most about
+ * 2 * QUEUE_DEPTH + 3 images are alive at once, however many jobs there are.
+ * Images travel in the queues rather than in the jobs. Returns the exit status. */
+int process_pipelined(struct Batch *b)
+{
+    struct Pipeline pl = {.batch = b};
+    queue_init(&pl.loaded);
+    queue_init(&pl.converted);
+
+    pthread_t reader, transform;
+    if (pthread_create(&reader, NULL, pipeline_reader, &pl) != 0) {
+        fprintf(stderr, "Unable to start pipeline threads.\n");
+        return 1;
+    }
+    if (pthread_create(&transform, NULL, pipeline_transform, &pl) != 0) {
+        fprintf(stderr, "Unable to start pipeline threads.\n");
+        queue_cancel(&pl.loaded);
+        pthread_join(reader, NULL);
+        queue_destroy(&pl.loaded);
+        return 1;
+    }
+
+    /* Writer stage: apply the second and third processes in input order */
+    int status = 0;
+    int done = 0;
+    struct QueueItem item;
+    while (status == 0 && queue_pop(&pl.converted, &item)) {
+        if (item.img == NULL) {
+            status = 1;     // The failing stage has already reported the error
+            break;
+        }
+
+        struct Job *job = &b->jobs[item.index];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        bool coded = code_image(item.img, job->code_copy);
+        stage_end(&probe, job, STAGE_CODE);
+        if (!coded) {
+            fprintf(stderr, "Second process failed for file %s .\n", job->output);
+            status = 1;
+        } else {
+            printf("\n");   // line between images code
+            stage_begin(&probe);
+            bool saved = save_output(item.img, job->output);
+            stage_end(&probe, job, STAGE_SAVE);
+            if (!saved) {
+                fprintf(stderr, "Saving image to %s failed.\n", job->output);
+                status = 1;
+            }
+        }
+        free_image(item.img);
+        done++;
+    }
+    if (status == 0 && done < b->count)
+        status = 1;
+
+    queue_cancel(&pl.converted);
+    pthread_join(transform, NULL);
+    pthread_join(reader, NULL);
+    queue_destroy(&pl.loaded);
+    queue_destroy(&pl.converted);
+    return status;
+}
+
+/* Take an unused slot of aio for req and count it in flight. The caller
+ * keeps inflight below depth. */
+static int aio_take_slot(struct AsyncIO *aio, const struct AioRequest *req)
+{
+    int s = aio->free_slots[--aio->free_count];
+    aio->slots[s] = *req;
+    aio->done[s] = 0;
+    aio->inflight++;
+    return s;
+}
+
+#ifdef HAVE_IO_URING
+/* Set up the rings of aio with raw system calls. Returns false when the
+ * kernel has no io_uring, or one too old for IORING_OP_READ and
+ * IORING_OP_WRITE (which arrived with IORING_FEAT_RW_CUR_POS, Linux 5.6). */
+bool uring_init(struct AsyncIO *aio)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = (int)syscall(__NR_io_uring_setup, (unsigned)aio->depth, &p);
+    if (fd < 0)
+        return false;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return false;
+    }
+
+    aio->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sq_ring = mmap(NULL, aio->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = mmap(NULL, aio->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if (aio->sq_ring != MAP_FAILED)
+            munmap(aio->sq_ring, aio->sq_ring_len);
+        if (aio->cq_ring != MAP_FAILED)
+            munmap(aio->cq_ring, aio->cq_ring_len);
+        if (aio->sqes != MAP_FAILED)
+            munmap(aio->sqes, aio->sqes_len);
+        close(fd);
+        return false;
+    }
+
+    aio->ring_fd = fd;
+    aio->sq_tail = (unsigned *)((char *)aio->sq_ring + p.sq_off.tail);
+    aio->sq_mask = (unsigned *)((char *)aio->sq_ring + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)((char *)aio->sq_ring + p.sq_off.array);
+    aio->cq_head = (unsigned *)((char *)aio->cq_ring + p.cq_off.head);
+    aio->cq_tail = (unsigned *)((char *)aio->cq_ring + p.cq_off.tail);
+    aio->cq_mask = (unsigned *)((char *)aio->cq_ring + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ring + p.cq_off.cqes);
+    aio->unsubmitted = 0;
+    return true;
+}
+
+/* Queue what is left of the request in slot s on the submission ring. It
+ * reaches the kernel with the next io_uring_enter, in uring_wait. */
+void uring_queue(struct AsyncIO *aio, int s)
+{
+    const struct AioRequest *req = &aio->slots[s];
+    unsigned tail = *aio->sq_tail;      // Only this thread moves the tail
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    size_t left = req->len - aio->done[s];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = req->op == AIO_READ ? IORING_OP_READ : req->op == AIO_WRITE ? IORING_OP_WRITE : IORING_OP_FSYNC;
+    sqe->fd = req->fd;
+    if (req->op != AIO_FSYNC) {
+        sqe->addr = (uint64_t)(uintptr_t)((char *)req->buf + aio->done[s]);
+        sqe->len = left < AIO_OP_MAX ? (unsigned)left : AIO_OP_MAX;
+        sqe->off = (uint64_t)req->offset + aio->done[s];
+    }
+    sqe->user_data = (uint64_t)s;
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+}
+
+/* Submit whatever is queued and collect one completion into *slot and
+ * *res, waiting for it if there is none yet. Returns false if
+ * io_uring_enter fails. */
+bool uring_wait(struct AsyncIO *aio, int *slot, ssize_t *res)
+{
+    for (;;) {
+        unsigned head = *aio->cq_head;  // Only this thread moves the head
+        bool ready = head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+        if (ready && aio->unsubmitted == 0) {
+            const struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+            *slot = (int)cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        long n = syscall(__NR_io_uring_enter, aio->ring_fd, aio->unsubmitted, ready ? 0 : 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR)
+            return false;
+        if (n > 0)
+            aio->unsubmitted -= (unsigned)n;
+    }
+}
+#endif
+
+/* Carry out req with blocking calls, the whole transfer unless a read
+ * meets the end of the file. Returns what becomes req->result. */
+ssize_t aio_perform(const struct AioRequest *req)
+{
+    if (req->op == AIO_FSYNC)
+        return fsync(req->fd) == 0 ? 0 : -errno;
+
+    size_t done = 0;
+    while (done < req->len) {
+        size_t n = req->len - done < AIO_OP_MAX ? req->len - done : AIO_OP_MAX;
+        ssize_t got = req->op == AIO_READ ? pread(req->fd, (char *)req->buf + done, n, req->offset + done)
+                                          : pwrite(req->fd, (char *)req->buf + done, n, req->offset + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -errno;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return (ssize_t)done;
+}
+
+/* Thread of the thread-pool backend: carry out queued requests one at a
+ * time until aio stops. */
+void *aio_thread(void *arg)
+{
+    struct AsyncIO *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->queued_count == 0 && !aio->stop)
+            pthread_cond_wait(&aio->work, &aio->lock);
+        if (aio->queued_count == 0)
+            break;
+        int s = aio->queued[aio->queued_head];
+        aio->queued_head = (aio->queued_head + 1) % aio->depth;
+        aio->queued_count--;
+        pthread_mutex_unlock(&aio->lock);
+
+        ssize_t res = aio_perform(&aio->slots[s]);
+
+        pthread_mutex_lock(&aio->lock);
+        aio->slots[s].result = res;
+        aio->completed[(aio->completed_head + aio->completed_count++) % aio->depth] = s;
+        pthread_cond_signal(&aio->finished);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+/* Release aio, which must have nothing in flight */
+void aio_destroy(struct AsyncIO *aio)
+{
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = true;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    for (int t = 0; t < aio->thread_count; t++)
+        pthread_join(aio->threads[t], NULL);
+#ifdef HAVE_IO_URING
+    if (aio->backend == AIO_URING) {
+        munmap(aio->sq_ring, aio->sq_ring_len);
+        munmap(aio->cq_ring, aio->cq_ring_len);
+        munmap(aio->sqes, aio->sqes_len);
+        close(aio->ring_fd);
+    }
+#endif
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->finished);
+    free(aio->threads);
+    free(aio->slots);
+    free(aio->done);
+    free(aio->free_slots);
+    free(aio->queued);
+    free(aio->completed);
+}
+
+/* Prepare aio to keep up to depth requests in flight through backend:
+ * io_uring if asked for or, with AIO_AUTO, if the kernel has it, otherwise
+ * a pool of up to AIO_THREADS_MAX threads. On error, prints a message and
+ * returns false. */
+bool aio_init(struct AsyncIO *aio, int depth, enum AioBackend backend)
+{
+    *aio = (struct AsyncIO){.depth = depth, .backend = AIO_THREADS};
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->finished, NULL);
+    aio->slots = malloc(depth * sizeof *aio->slots);
+    aio->done = malloc(depth * sizeof *aio->done);
+    aio->free_slots = malloc(depth * sizeof *aio->free_slots);
+    aio->queued = malloc(depth * sizeof *aio->queued);
+    aio->completed = malloc(depth * sizeof *aio->completed);
+    if (aio->slots == NULL || aio->done == NULL || aio->free_slots == NULL || aio->queued == NULL
+        || aio->completed == NULL) {
+        fprintf(stderr, "Unable to allocate memory for %d asynchronous requests.\n", depth);
+        aio_destroy(aio);
+        return false;
+    }
+    counters.allocations += 5;
+    for (int s = depth - 1; s >= 0; s--)
+        aio->free_slots[aio->free_count++] = s;
+
+#ifdef HAVE_IO_URING
+    if (backend != AIO_THREADS && uring_init(aio)) {
+        aio->backend = AIO_URING;
+        return true;
+    }
+#endif
+    if (backend == AIO_URING) {
+        fprintf(stderr, "io_uring is not available on this system.\n");
+        aio_destroy(aio);
+        return false;
+    }
+
+    int threads = depth < AIO_THREADS_MAX ? depth : AIO_THREADS_MAX;
+    aio->threads = malloc(threads * sizeof *aio->threads);
+    bool ok = aio->threads != NULL;
+    for (; ok && aio->thread_count < threads; aio->thread_count++)
+        ok = pthread_create(&aio->threads[aio->thread_count], NULL, aio_thread, aio) == 0;
+    if (!ok) {
+        fprintf(stderr, "Unable to start %d I/O threads.\n", threads);
+        aio_destroy(aio);
+    }
+    return ok;
+}
+
+/* Start req. The caller keeps aio->inflight below aio->depth. */
+void aio_submit(struct AsyncIO *aio, const struct AioRequest *req)
+{
+    int s = aio_take_slot(aio, req);
+#ifdef HAVE_IO_URING
+    if (aio->backend == AIO_URING) {
+        uring_queue(aio, s);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&aio->lock);
+    aio->queued[(aio->queued_head + aio->queued_count++) % aio->depth] = s;
+    pthread_cond_signal(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/* Wait for the next request of aio to complete, in any order, and store it
+ * with its result in *req. Returns false when nothing is in flight or the
+ * backend fails. */
+bool aio_wait(struct AsyncIO *aio, struct AioRequest *req)
+{
+    if (aio->inflight == 0)
+        return false;
+
+    int s;
+#ifdef HAVE_IO_URING
+    if (aio->backend == AIO_URING) {
+        for (;;) {
+            ssize_t res;
+            if (!uring_wait(aio, &s, &res))
+                return false;
+            struct AioRequest *r = &aio->slots[s];
+            if (res > 0)
+                aio->done[s] += res;
+            if (res > 0 && r->op != AIO_FSYNC && aio->done[s] < r->len) {
+                uring_queue(aio, s);    // Only part was transferred: go on from there
+                continue;
+            }
+            r->result = res < 0 ? res : r->op == AIO_FSYNC ? 0 : (ssize_t)aio->done[s];
+            break;
+        }
+    } else
+#endif
+    {
+        pthread_mutex_lock(&aio->lock);
+        while (aio->completed_count == 0)
+            pthread_cond_wait(&aio->finished, &aio->lock);
+        s = aio->completed[aio->completed_head];
+        aio->completed_head = (aio->completed_head + 1) % aio->depth;
+        aio->completed_count--;
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    *req = aio->slots[s];
+    aio->free_slots[aio->free_count++] = s;
+    aio->inflight--;
+    return true;
+}
+
+/* What process_async is waiting for on one job */
+enum AsyncStep {
+    ASYNC_HEADER,       // The first HEADER_MAX bytes of the input
+    ASYNC_PAYLOAD,      // The pixels of an HS16 input, read straight into the bitmap
+    ASYNC_SAVE,         // The header and bitmap writes of the output
+    ASYNC_FSYNC         // The output reaching stable storage (--fsync)
+};
+
+/* Progress of one job of process_async */
+struct AsyncJob {
+    enum AsyncStep step;
+    int fd;                             // The input while loading, the output while saving
+    int pending;                        // Requests in flight
+    bool failed;                        // A request of the current step failed
+    bool ready;                         // The input is loaded and waits to be converted
+    struct Header h;
+    char head[HEADER_MAX];              // Header as read, or as written
+};
+
+/* Start loading job i: read its header through aio, or, when the reads
+ * must be done another way (direct is false, for --region, --planar or
+ * --pad-rows), load it with load_job now. Returns false on error, after
+ * printing a message. */
+bool async_load_start(struct AsyncIO *aio, struct Job *job, struct AsyncJob *aj, int i, bool direct)
+{
+    if (!direct) {
+        job->in = load_job(job);
+        aj->ready = job->in != NULL;
+        return aj->ready;
+    }
+
+    aj->fd = open(job->input, O_RDONLY);
+    if (aj->fd < 0) {
+        fprintf(stderr, "File %s could not be opened.\n", job->input);
+        return false;
+    }
+    aj->step = ASYNC_HEADER;
+    aj->pending = 1;
+    aio_submit(aio, &(struct AioRequest){AIO_READ, aj->fd, aj->head, HEADER_MAX, 0, i, 0});
+    return true;
+}
+
+/* Start saving the converted image of job i through aio: the header and
+ * the bitmap are written as two requests at their offsets. Returns false on
+ * error, after printing a message. */
+bool async_save_start(struct AsyncIO *aio, struct Job *job, struct AsyncJob *aj, int i)
+{
+    const struct Image *img = job->out;
+    int header_len = snprintf(aj->head, sizeof(aj->head), "%s\t%i\t%i ", IMG_FORMAT, img->width, img->height);
+    aj->fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (aj->fd < 0 || header_len < 0 || (size_t)header_len >= sizeof(aj->head)) {
+        fprintf(stderr, "Saving image to %s failed.\n", job->output);
+        if (aj->fd >= 0)
+            close(aj->fd);
+        aj->fd = -1;
+        return false;
+    }
+    aj->step = ASYNC_SAVE;
+    aj->pending = 2;
+    aj->failed = false;
+    aio_submit(aio, &(struct AioRequest){AIO_WRITE, aj->fd, aj->head, header_len, 0, i, 0});
+    aio_submit(aio, &(struct AioRequest){AIO_WRITE, aj->fd, img->pixels,
+                                         (size_t)img->width * img->height * sizeof(struct Pixel), header_len, i, 0});
+    return true;
+}
+
+/* Act on the completion r of a request of job: check the header and read
+ * the payload after it, finish a load, or finish a save by syncing
+ * (--fsync), closing and releasing the image. Returns false when the job
+ * failed, after printing a message. */
+bool async_complete(struct AsyncIO *aio, struct Job *job, struct AsyncJob *aj, const struct AioRequest *r)
+{
+    aj->pending--;
+    if (r->op != AIO_FSYNC && r->result != (ssize_t)r->len && !(aj->step == ASYNC_HEADER && r->result >= 0))
+        aj->failed = true;
+    if (r->op == AIO_FSYNC && r->result != 0)
+        aj->failed = true;
+    if (aj->pending > 0)
+        return true;
+
+    if (aj->step == ASYNC_HEADER) {
+        counters.bytes_read += r->result > 0 ? r->result : 0;
+        if (aj->failed || !check_header(aj->head, r->result, aj->fd, job->input, &aj->h)) {
+            if (aj->failed)
+                fprintf(stderr, "Failed to read pixel data from file %s.\n", job->input);
+            close(aj->fd);
+            aj->fd = -1;
+            return false;
+        }
+
+        /* Compressed and tiled inputs are decoded by the blocking path */
+        if (aj->h.format != FORMAT_HS16) {
+            close(aj->fd);
+            aj->fd = -1;
+            job->in = load_job(job);
+            aj->ready = job->in != NULL;
+            return aj->ready;
+        }
+
+        job->in = new_image(aj->h.width, aj->h.height, LAYOUT_INTERLEAVED);
+        if (job->in == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", aj->h.width, aj->h.height, job->input);
+            close(aj->fd);
+            aj->fd = -1;
+            return false;
+        }
+        aj->step = ASYNC_PAYLOAD;
+        aj->pending = 1;
+        aio_submit(aio, &(struct AioRequest){AIO_READ, aj->fd, job->in->pixels,
+                                             (size_t)aj->h.width * aj->h.height * sizeof(struct Pixel),
+                                             aj->h.offset, r->tag, 0});
+        return true;
+    }
+
+    if (aj->step == ASYNC_PAYLOAD) {
+        close(aj->fd);
+        aj->fd = -1;
+        if (aj->failed) {
+            fprintf(stderr, "Failed to read pixel data from file %s.\n", job->input);
+            return false;
+        }
+        counters.bytes_read += r->result;
+        if (aj->h.swap)
+            swap_samples((uint16_t *)job->in->pixels, (size_t)job->in->width * job->in->height * 3);
+
+        /* --stats counts the loaded bitmap, as for mapped inputs */
+        if (stats_format != METRICS_OFF) {
+            struct Histogram *hist = calloc(1, sizeof *hist);
+            if (hist == NULL || !image_histogram(job->in, hist)) {
+                fprintf(stderr, "Unable to allocate memory for the histograms of %s.\n", job->input);
+                free(hist);
+                return false;
+            }
+            counters.allocations++;
+            histogram_stats(hist, job->stats);
+            free(hist);
+        }
+        aj->ready = true;
+        return true;
+    }
+
+    if (aj->step == ASYNC_SAVE && !aj->failed && fsync_on_close) {
+        aj->step = ASYNC_FSYNC;
+        aj->pending = 1;
+        aio_submit(aio, &(struct AioRequest){AIO_FSYNC, aj->fd, NULL, 0, 0, r->tag, 0});
+        return true;
+    }
+
+    if (close(aj->fd) != 0)
+        aj->failed = true;
+    aj->fd = -1;
+    if (aj->failed) {
+        fprintf(stderr, "Saving image to %s failed.\n", job->output);
+        return false;
+    }
+    counters.bytes_written += (uint64_t)strlen(aj->head) + (uint64_t)job->out->width * job->out->height * sizeof(struct Pixel);
+    free_image(job->out);
+    job->out = NULL;
+    return true;
+}
+
+/* Collect the next completion of aio for the jobs of b, storing the index
+ * of its job in *i and adding the time waited to the job's load or save
+ * stage. Returns false when the completion failed its job or the backend
+ * failed. */
+bool async_next(struct AsyncIO *aio, struct Batch *b, struct AsyncJob *jobs, int *i)
+{
+    struct StageProbe probe;
+    stage_begin(&probe);
+    struct AioRequest r;
+    if (!aio_wait(aio, &r)) {
+        fprintf(stderr, "Asynchronous I/O failed.\n");
+        return false;
+    }
+    struct AsyncJob *aj = &jobs[r.tag];
+    *i = r.tag;
+    bool ok = async_complete(aio, &b->jobs[r.tag], aj, &r);
+    stage_end(&probe, &b->jobs[r.tag], aj->step >= ASYNC_SAVE ? STAGE_SAVE : STAGE_LOAD);
+    return ok;
+}
+
+/* Apply the --ops chain (MONO by default), --filter and --resize to the
+ * loaded input of job, like main does. Returns false on error. */
+bool async_convert(struct Job *job)
+{
+    struct StageProbe probe;
+    stage_begin(&probe);
+    job->out = transform_image(job->in);
+    stage_end(&probe, job, STAGE_MONO);
+    job->in = NULL;
+    if (job->out == NULL) {
+        fprintf(stderr, "First process failed for file %s.\n", job->input);
+        return false;
+    }
+    return true;
+}
+
+/* Process the jobs of b like main does, but with up to async_depth reads
+ * and writes in flight across the batch (--async) instead of one blocking
+ * call at a time. Every input's header is read, then its pixels straight
+ * into the bitmap, and each image is converted as soon as it is in while
+ * the other reads carry on. Images are then printed in order, each save
+ * queued as a header write and a bitmap write while the next is printed.
+ * Inputs and outputs that need decoding or encoding (HS1Z, HS1T, --planar,
+ * --pyramid and so on) take the blocking path within the same loop.
+ * Returns the exit status. */
+int process_async(struct Batch *b)
+{
+    struct AsyncIO aio;
+    if (!aio_init(&aio, async_depth, async_backend))
+        return 1;
+    struct AsyncJob *jobs = calloc(b->count, sizeof *jobs);
+    if (jobs == NULL) {
+        fprintf(stderr, "Unable to allocate memory for %d images.\n", b->count);
+        aio_destroy(&aio);
+        return 1;
+    }
+    counters.allocations++;
+    for (int i = 0; i < b->count; i++)
+        jobs[i].fd = -1;
+
+    /* Keep the queue full of header and payload reads, converting each
+     * image once it is in */
+    bool direct_load = image_layout == LAYOUT_INTERLEAVED && !pad_rows && region.width == 0;
+    bool ok = true;
+    for (int next = 0; ok && (next < b->count || aio.inflight > 0);) {
+        int i;
+        if (next < b->count && aio.inflight < aio.depth) {
+            struct StageProbe probe;
+            stage_begin(&probe);
+            i = next++;
+            ok = async_load_start(&aio, &b->jobs[i], &jobs[i], i, direct_load);
+            stage_end(&probe, &b->jobs[i], STAGE_LOAD);
+        } else {
+            ok = async_next(&aio, b, jobs, &i);
+        }
+        if (ok && jobs[i].ready) {
+            jobs[i].ready = false;
+            ok = async_convert(&b->jobs[i]);
+        }
+    }
+
+    /* Print in order, queueing each plain HS16 save behind the previous ones */
+    bool direct_save = !compress_output && tile_width == 0 && pyramid_levels == 0;
+    for (int i = 0; ok && i < b->count; i++) {
+        struct Job *job = &b->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        bool coded = code_image(job->out, job->code_copy);
+        stage_end(&probe, job, STAGE_CODE);
+        if (!coded) {
+            fprintf(stderr, "Second process failed for file %s .\n", job->output);
+            ok = false;
+            break;
+        }
+        printf("\n");   // line between images code
+
+        if (!direct_save || job->out->layout != LAYOUT_INTERLEAVED || job->out->stride != (size_t)job->out->width) {
+            stage_begin(&probe);
+            bool saved = save_output(job->out, job->output);
+            stage_end(&probe, job, STAGE_SAVE);
+            if (!saved) {
+                fprintf(stderr, "Saving image to %s failed.\n", job->output);
+                ok = false;
+            }
+            free_image(job->out);
+            job->out = NULL;
+            continue;
+        }
+
+        int done;
+        while (ok && aio.inflight + 2 > aio.depth)
+            ok = async_next(&aio, b, jobs, &done);
+        if (ok) {
+            stage_begin(&probe);
+            ok = async_save_start(&aio, job, &jobs[i], i);
+            stage_end(&probe, job, STAGE_SAVE);
+        }
+    }
+    for (int done; ok && aio.inflight > 0;)
+        ok = async_next(&aio, b, jobs, &done);
+
+    /* After an error, let what is in flight finish before its buffers go */
+    struct AioRequest r;
+    while (aio_wait(&aio, &r))
+        if (--jobs[r.tag].pending == 0 && jobs[r.tag].fd >= 0) {
+            close(jobs[r.tag].fd);
+            jobs[r.tag].fd = -1;
+        }
+
+    aio_destroy(&aio);
+    free(jobs);
+    return ok ? 0 : 1;
+}
+
+/* Prepare zw to compress a stream of rows of width pixels. Returns false
+ * when out of memory. */
+bool chunk_writer_init(struct ChunkWriter *zw, int width)
+{
+    zw->capacity = chunk_rows(width);
+    zw->rows = (struct Image){.width = width, .stride = (size_t)width, .layout = LAYOUT_INTERLEAVED,
+                              .storage = STORAGE_HEAP};
+    zw->rows.pixels = malloc((size_t)zw->capacity * width * sizeof(struct Pixel));
+    zw->buf = malloc(4 + zimg_chunk_bound((size_t)zw->capacity * width));
+    counters.allocations += 2;
+    return zw->rows.pixels != NULL && zw->buf != NULL;
+}
+
+/* Release the buffers of zw */
+void chunk_writer_free(struct ChunkWriter *zw)
+{
+    free(zw->rows.pixels);
+    free(zw->buf);
+}
+
+/* Encode the rows collected in zw, if any, as one chunk and write it to out */
+bool chunk_writer_flush(struct ChunkWriter *zw, FILE *out)
+{
+    if (zw->rows.height == 0)
+        return true;
+    size_t n = zimg_encode_chunk(&zw->rows, 0, zw->rows.height, zw->buf + 4);
+    zimg_put_len(zw->buf, (uint32_t)n);
+    zw->rows.height = 0;
+    if (fwrite(zw->buf, 1, n + 4, out) != n + 4)
+        return false;
+    counters.bytes_written += n + 4;
+    return true;
+}
+
+/* Append n pixels, a whole number of rows, to zw, writing each chunk to out
+ * as it fills up */
+bool chunk_writer_put(struct ChunkWriter *zw, FILE *out, const struct Pixel *p, size_t n)
+{
+    bool ok = true;
+    for (size_t j = 0; ok && j < n; j += zw->rows.width) {
+        memcpy(image_row(&zw->rows, zw->rows.height++), p + j, zw->rows.width * sizeof *p);
+        if (zw->rows.height == zw->capacity)
+            ok = chunk_writer_flush(zw, out);
+    }
+    return ok;
+}
+
+/* One level of a streamed pyramid, reducing each pair of rows of the level
+ * above to one row of its own as the second of them arrives */
+struct PyramidLevel {
+    FILE *out;
+    struct ChunkWriter zw;              // Collects rows into HS1Z chunks with --compress
+    int in_width;                       // Width of the level above
+    int width;
+    bool pending;                       // Whether above holds the first row of a pair
+    struct Pixel *above;
+    struct Pixel *row;                  // The row last reduced
 };
 
-struct Image *fip;   // Pointer to first input Image struct
-struct Image *fop;   // Pointer to first output Image struct
+/* The --pyramid levels of a streamed output, written beside it */
+struct PyramidWriter {
+    int levels;
+    bool ok;                            // False once a level has failed to be written
+    struct PyramidLevel level[PYRAMID_MAX];
+};
 
-/* Free a struct Image */
-void free_image(struct Image *img)
+/* Open the pyramid_depth levels of a width x height output saved to
+ * filename, each level a file with its header written. On error, prints a
+ * message and returns false; pw must be closed with pyramid_writer_close
+ * either way. */
+bool pyramid_writer_open(struct PyramidWriter *pw, const char *filename, int width, int height)
 {
-    /* Inner pointers must be freed before the structure holding it */
-    /* As both the array of pointers and the individual rows were allocated with calloc, they must be freed individually */
-    for (int i = 0; i < img->height; i++)
-        free(img->pixels[i]);
-    free(img->pixels);
-    free(img);
+    *pw = (struct PyramidWriter){.levels = pyramid_depth(width, height), .ok = true};
+    for (int k = 0; k < pw->levels; k++) {
+        struct PyramidLevel *l = &pw->level[k];
+        char name[MAX_FILENAME + 1];
+        l->in_width = width;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        l->width = width;
+        if (!pyramid_name(filename, k + 1, name)) {
+            fprintf(stderr, "File name %s is too long for its pyramid levels.\n", filename);
+            return pw->ok = false;
+        }
+
+        l->above = malloc((size_t)l->in_width * sizeof(struct Pixel));
+        l->row = malloc((size_t)width * sizeof(struct Pixel));
+        counters.allocations += 2;
+        if (l->above == NULL || l->row == NULL || (compress_output && !chunk_writer_init(&l->zw, width))) {
+            fprintf(stderr, "Unable to allocate memory for pyramid level %s.\n", name);
+            return pw->ok = false;
+        }
+
+        l->out = fopen(name, "w");
+        int header_len = l->out == NULL ? -1 : compress_output
+            ? fprintf(l->out, "%s\t%i\t%i\t%i ", ZIMG_FORMAT, width, height, l->zw.capacity)
+            : fprintf(l->out, "%s\t%i\t%i ", IMG_FORMAT, width, height);
+        if (header_len <= 0) {
+            fprintf(stderr, "Saving image to %s failed.\n", name);
+            return pw->ok = false;
+        }
+        counters.bytes_written += header_len;
+    }
+    return true;
 }
 
-/* Free Images */
-void free_list (struct Image *fp)
+/* Hand the next row of the level above level k (the output itself for
+ * level 0) to pw. Every second row completes a row of level k, which is
+ * written and handed on to level k + 1. */
+void pyramid_writer_put(struct PyramidWriter *pw, int k, const struct Pixel *row)
 {
-    while(fp != NULL){
+    if (k == pw->levels || !pw->ok)
+        return;
+    struct PyramidLevel *l = &pw->level[k];
+    if (!l->pending) {
+        memcpy(l->above, row, (size_t)l->in_width * sizeof *row);
+        l->pending = true;
+        return;
+    }
 
-        if(fp->next != NULL){
-            struct Image *temp = fp->next;
-            int w = fp->width;
-            free_image(fp);
-            fp = temp;
-        }
-        int w = fp->width;
-        free_image(fp);
-        fp = NULL;
+    pyramid_row((const uint16_t *)l->above, (const uint16_t *)row, (uint16_t *)l->row, l->in_width, l->width, 3);
+    l->pending = false;
+    if (compress_output) {
+        pw->ok = chunk_writer_put(&l->zw, l->out, l->row, l->width);
+    } else {
+        pw->ok = fwrite(l->row, sizeof *l->row, l->width, l->out) == (size_t)l->width;
+        if (pw->ok)
+            counters.bytes_written += l->width * sizeof *l->row;
+    }
+    pyramid_writer_put(pw, k + 1, l->row);
+}
 
+/* Finish the levels of pw from the top down, reducing a last odd row of
+ * each with itself, close their files and release pw. Returns whether every
+ * level was saved. */
+bool pyramid_writer_close(struct PyramidWriter *pw)
+{
+    for (int k = 0; k < pw->levels; k++) {
+        struct PyramidLevel *l = &pw->level[k];
+        if (pw->ok && l->pending)
+            pyramid_writer_put(pw, k, l->above);
+        if (l->out != NULL) {
+            if (pw->ok && compress_output)
+                pw->ok = chunk_writer_flush(&l->zw, l->out);
+            if (pw->ok && fsync_on_close)
+                pw->ok = fflush(l->out) == 0 && fsync(fileno(l->out)) == 0;
+            if (fclose(l->out) != 0)
+                pw->ok = false;
+        }
+        chunk_writer_free(&l->zw);
+        free(l->above);
+        free(l->row);
     }
+    return pw->ok;
 }
 
-/* Create a dinamically allocated Pixel bitmap that can 
- * decide the numbers of rows at run-time.  */
-struct Pixel **makeBitmap(int m, int n)
+/* Print and save n converted pixels of the image streamed for job, adding
+ * the time to the job's CODE and save stages. Pixels go through zw when it
+ * is not NULL (--compress), and their rows on to the pyramid levels of pw
+ * (--pyramid). *saved turns false once a write to out has failed, or if out
+ * is NULL. */
+void stream_emit(struct Job *job, struct CodeWriter *cw, FILE *out, struct ChunkWriter *zw,
+                 struct PyramidWriter *pw, bool *saved, const struct Pixel *p, size_t n)
 {
-    // pointer to array of pointers to Pixels array
-    struct Pixel **newb = calloc(m, sizeof(struct Pixel *));
-    for (int i = 0; i < m; i++)
-        newb[i] = calloc(n, sizeof(struct Pixel));
-    // returns an array of m arrays each containing n Pixels
-    return newb;
+    struct StageProbe probe;
+    stage_begin(&probe);
+    code_row(cw, p, n);
+    stage_end(&probe, job, STAGE_CODE);
+
+    stage_begin(&probe);
+    if (*saved && zw != NULL) {
+        *saved = chunk_writer_put(zw, out, p, n);
+    } else if (*saved) {
+        *saved = fwrite(p, sizeof(struct Pixel), n, out) == n;
+        if (*saved)
+            counters.bytes_written += n * sizeof(struct Pixel);
+    }
+    for (size_t j = 0; *saved && pw->levels > 0 && j < n; j += pw->level[0].in_width)
+        pyramid_writer_put(pw, 0, p + j);
+    stage_end(&probe, job, STAGE_SAVE);
 }
 
-/* Read data from file into Pixel bitmap. */
-int readBitmap(FILE * f, struct Pixel **B, int m, int n)
+/* Apply MONO (or the --ops chain), CODE and saving to the input of job as
+ * it is read, a chunk of rows at a time, writing its output as each chunk is
+ * converted. Only one chunk of about IO_CHUNK_PIXELS pixels is ever in
+ * memory, whatever the image size; with --resize, rows go through a
+ * Resampler, which holds a few more. Each stage's share of every chunk is
+ * added to the job's metrics. Errors are reported like the whole-image path.
+ * Returns false on error. */
+bool stream_image(struct Job *job)
 {
-    for (int i = 0; i < m; i++)
-        for (int j = 0; j < n; j++)
-            /* Read one 16-bit unsigned integer from file f into value and 
-             * insert into each color inside of each Pixel */
-            for (int c = 0; c < 3; c++){
+    const char *input = job->input;
+    const char *output = job->output;
+    struct StageProbe probe;
+    stage_begin(&probe);
+    FILE *in = fopen(input, "r");
+    if (in == NULL) {
+        fprintf(stderr, "File %s could not be opened.\n", input);
+        return false;
+    }
 
-                uint16_t val;
+    struct Header h;
+    if (!read_header(in, input, &h)) {
+        fclose(in);
+        return false;
+    }
+    if (h.format == FORMAT_HS1T) {
+        fprintf(stderr, "File %s is tiled and cannot be streamed.\n", input);
+        fclose(in);
+        return false;
+    }
+    int width = h.width, height = h.height, zrows = h.chunk_rows;
+    counters.bytes_read += (uint64_t)h.offset;
 
-                /* Check for error, EOF would also be an error as the logic does not allow EOF 
-                 * to be reached, as iteration accounts for exact amount of reads the 
-                 * method should perform (m*n). 
-                 * On Error function returns one, which is dealt with when function is called,
-                 * as memory for pointers unreacheable in this scope would have to be freed. 
-                 * fread is used instead of fscanf so uint16_t data type can be used, 
-                 * rather than short int. */
-                if(fread(&val, sizeof(uint16_t), 1, f) != 1 ){
-                    return 1;
-                }
+    /* The chunk is a one-band interleaved image that MONO converts in place.
+     * HS1Z input is decoded into it one of the file's own chunks at a time.
+     * With --stats, each chunk is counted as it is read. */
+    int rows = zrows == 0 ? chunk_rows(width) : zrows < height ? zrows : height;
+    size_t zbound = zimg_chunk_bound((size_t)rows * width);
+    struct Image chunk = {.width = width, .stride = (size_t)width, .layout = LAYOUT_INTERLEAVED, .storage = STORAGE_HEAP};
+    chunk.pixels = malloc((size_t)rows * width * sizeof(struct Pixel));
+    uint8_t *zbuf = zrows > 0 ? malloc(zbound) : NULL;
+    struct Histogram *hist = stats_format != METRICS_OFF ? calloc(1, sizeof *hist) : NULL;
+    if (chunk.pixels == NULL || (zrows > 0 && zbuf == NULL) || (stats_format != METRICS_OFF && hist == NULL)) {
+        fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", width, height, input);
+        free(hist);
+        free(zbuf);
+        free(chunk.pixels);
+        fclose(in);
+        return false;
+    }
+    counters.allocations += 1 + (zbuf != NULL) + (hist != NULL);
+    stage_end(&probe, job, STAGE_LOAD);
 
-                switch(c){
-                    case 0: (B[i][j]).red = val; break;
-                    case 1: (B[i][j]).green = val; break;
-                    case 2: (B[i][j]).blue = val; break;
-                }
+    /* With --compress, output rows are collected into chunks by zw */
+    bool resizing = resize_width != 0 || resize_height != 0;
+    int out_width = width, out_height = height;
+    struct Resampler rs = {0};
+    struct ChunkWriter zw = {0};
+    struct ChunkWriter *zout = compress_output ? &zw : NULL;
+    if (resizing)
+        resize_dimensions(width, height, &out_width, &out_height);
+    if ((resizing && !resampler_init(&rs, width, height, out_width, out_height, resize_method))
+        || (zout != NULL && !chunk_writer_init(zout, out_width))) {
+        fprintf(stderr, "Unable to allocate memory for %dx%d image %s.\n", out_width, out_height, output);
+        resampler_free(&rs);
+        chunk_writer_free(&zw);
+        free(hist);
+        free(zbuf);
+        free(chunk.pixels);
+        fclose(in);
+        return false;
+    }
 
-            }
+    stage_begin(&probe);
+    FILE *out = fopen(output, "w");
+    int header_len = out == NULL ? -1 : zout != NULL
+        ? fprintf(out, "%s\t%i\t%i\t%i ", ZIMG_FORMAT, out_width, out_height, zw.capacity)
+        : fprintf(out, "%s\t%i\t%i ", IMG_FORMAT, out_width, out_height);
+    bool saved = header_len > 0;
+    if (saved)
+        counters.bytes_written += header_len;
+    struct PyramidWriter pw;
+    bool levels_open = pyramid_writer_open(&pw, output, out_width, out_height);
+    stage_end(&probe, job, STAGE_SAVE);
+    bool ok = levels_open;
 
-    return 0;
-}
+    struct CodeWriter cw;
+    stage_begin(&probe);
+    code_begin(&cw, stdout, out_width, out_height);
+    cw.copy = job->code_copy;
+    stage_end(&probe, job, STAGE_CODE);
 
-/* Opens and reads an image file, returning a pointer to a new struct Image.
- * On error, prints an error message and returns NULL. */
-struct Image *load_image(const char *filename)
-{
-    /* Open the file for reading */
-    FILE *f = fopen(filename, "r");
-    if (f == NULL) {
-        fprintf(stderr, "File %s could not be opened.\n", filename);
-        return NULL;
-    }
+    for (int i = 0; ok && i < height; i += rows) {
+        chunk.height = height - i < rows ? height - i : rows;
+        size_t count = (size_t)chunk.height * width;
+        stage_begin(&probe);
+        uint8_t prefix[4];
+        size_t got = zrows == 0 ? fread(chunk.pixels, 1, count * sizeof(struct Pixel), in)
+                                : fread(prefix, 1, 4, in);
+        bool read = zrows == 0 ? got == count * sizeof(struct Pixel) : got == 4;
+        if (read && zrows > 0) {
+            size_t zlen = zimg_get_len(prefix);
+            read = zlen <= zbound && fread(zbuf, 1, zlen, in) == zlen
+                   && zimg_decode_chunk(zbuf, zlen, &chunk, 0, chunk.height);
+            got += zlen;
+        }
+        if (!read) {
+            fprintf(stderr, "Failed to read pixel data from file %s.\n", input);
+            ok = false;
+            break;
+        }
+        counters.bytes_read += got;
+        if (h.swap)
+            swap_samples((uint16_t *)chunk.pixels, count * 3);
+        if (hist != NULL)
+            histogram_add_pixels(hist, chunk.pixels, count);
+        stage_end(&probe, job, STAGE_LOAD);
 
-    /* Allocate the Image object, and read the image from the file. */
+        stage_begin(&probe);
+        apply_ops_in_place(&chunk);
+        stage_end(&probe, job, STAGE_MONO);
 
-    /* Check that image file is the correct image format. */
-    /* Allocate format of image in file, extra char is needed in memory allocation of string. */
-    char format[5];
-    if(fscanf(f, "%4s", format) != 1 || strncmp(format, IMG_FORMAT, 4) != 0){
-        fprintf(stderr, "File %s is not in HS16 format.\n", filename);
-        fclose(f);
-        return NULL;
+        if (!resizing) {
+            stream_emit(job, &cw, out, zout, &pw, &saved, chunk.pixels, count);
+            continue;
+        }
+
+        /* Every output row is printed and saved as soon as its last input row is in */
+        for (int r = 0; r < chunk.height; r++) {
+            stage_begin(&probe);
+            resampler_push(&rs, image_row(&chunk, r));
+            const struct Pixel *row = resampler_next(&rs);
+            stage_end(&probe, job, STAGE_MONO);
+            while (row != NULL) {
+                stream_emit(job, &cw, out, zout, &pw, &saved, row, out_width);
+                stage_begin(&probe);
+                row = resampler_next(&rs);
+                stage_end(&probe, job, STAGE_MONO);
+            }
+        }
     }
 
-    /* Check that width and height are in the correct format. */
-    int width, height;
-    if(fscanf(f, "%d %d", &width, &height) != 2){
-        fprintf(stderr, "File %s does not provide appropiate width and height dimensions.\n", filename);
-        fclose(f);
-        return NULL;
+    if (ok) {
+        stage_begin(&probe);
+        code_end(&cw);
+        printf("\n");   // line between images code
+        stage_end(&probe, job, STAGE_CODE);
+    }
+    stage_begin(&probe);
+    if (out != NULL) {
+        if (saved && zout != NULL)
+            saved = chunk_writer_flush(zout, out);
+        if (saved && fsync_on_close)
+            saved = fflush(out) == 0 && fsync(fileno(out)) == 0;
+        if (fclose(out) != 0)
+            saved = false;
+    }
+    if (!pyramid_writer_close(&pw) && levels_open && saved) {
+        fprintf(stderr, "Saving the pyramid levels of %s failed.\n", output);
+        ok = false;
+    }
+    stage_end(&probe, job, STAGE_SAVE);
+    if (ok && !saved) {
+        fprintf(stderr, "Saving image to %s failed.\n", output);
+        ok = false;
     }
 
-    /* Dinamically allocate the Image struct and dimension fields. */
-    struct Image *img = malloc(sizeof *img);
-    if (img == NULL) {
-        fprintf(stderr, "Unable to allocate memory for Image struct.\n");
-        fclose(f);
-        return NULL;
+    if (hist != NULL) {
+        if (ok)
+            histogram_stats(hist, job->stats);
+        free(hist);
     }
+    resampler_free(&rs);
+    chunk_writer_free(&zw);
+    free(zbuf);
+    free(chunk.pixels);
+    fclose(in);
+    return ok;
+}
 
-    img->width = width;
-    img->height = height;
+/* Process the jobs of b one stage at a time: load every input, convert
+ * every image, then print and save each in order. Images still held by jobs
+ * when returning are freed by free_batch. Returns the exit status. */
+int process_jobs(struct Batch *b)
+{
+    /* Load every input image */
+    for (int i = 0; i < b->count; i++){
+
+        /* Load the input image */
+        struct Job *job = &b->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        job->in = load_job(job);
+        stage_end(&probe, job, STAGE_LOAD);
+        if(job->in == NULL)
+            return 1;
 
-    /* Allocate memory for Pixel bitmap */
-    img->pixels = makeBitmap(height, width);
-    if (img->pixels == NULL) {
-        fprintf(stderr, "Unable to allocate memory for pixel data.\n");
-        free(img); // Free the previously allocated Image struct
-        fclose(f);
-        return NULL;
     }
+    
+    /* Apply the first process (or --ops, --filter and --resize) to every image. The colour
+     * input is not needed afterwards, so it is converted in place and becomes the output
+     * without a second bitmap, unless it is resized. */
+
+    for (int i = 0; i < b->count; i++){
+
+        struct Job *job = &b->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        job->out = transform_image(job->in);
+        stage_end(&probe, job, STAGE_MONO);
+        job->in = NULL;
+        if (job->out == NULL) {
+            fprintf(stderr, "First process failed for file %s.\n", job->input);
+            return 1;
+        }
 
-    /* Read pixel data into Pixel bitmap */
-    int read_data = readBitmap(f, img->pixels, height, width);
-    if (read_data == 1) {
-        fprintf(stderr, "Failed to read pixel data from file %s.\n", filename);
-        free(img);
-        fclose(f);
-        return NULL;
     }
 
-    /* Close the file */
-    fclose(f);
-    return img;
-}
+    /* Apply second and third processes to every output in order */
 
-/* Write img to file filename. Return true on success, false on error. */
-bool save_image(const struct Image *img, const char *filename)
-{
-    /* Open the file for writing */
-    FILE *f = fopen(filename, "w");
-    if (f == NULL)
-        return false;
+    for (int i = 0; i < b->count; i++){
 
-    /* Write header */
+        /* Apply the second process  */
+        struct Job *job = &b->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        bool coded = code_image(job->out, job->code_copy);
+        stage_end(&probe, job, STAGE_CODE);
+        if (!coded) {
+            fprintf(stderr, "Second process failed for file %s .\n", job->output);
+            return 1;
+        }
 
-    fprintf(f, "%s\t", IMG_FORMAT);
-    fprintf(f, "%i\t", img->width);
-    fprintf(f, "%i ", img->height);
+        printf("\n");   // line between images code
 
-    /* Write Pixel values */
+        /* Save the output image */
+        stage_begin(&probe);
+        bool saved = save_output(job->out, job->output);
+        stage_end(&probe, job, STAGE_SAVE);
+        if (!saved) {
+            fprintf(stderr, "Saving image to %s failed.\n", job->output);
+            return 1;
+        }
 
-    for (int i = 0; i < img->height; i++)
-        for (int j = 0; j < img->width; j++)
-            /* Allocate 16-bit unsigned integer from each color inside of each Pixel 
-             * to value and write value in file */
-            for (int c = 0; c < 3; c++){
-
-                uint16_t value;
-                switch(c){
-                    case 0: value = (*img).pixels[i][j].red; break;
-                    case 1: value = (*img).pixels[i][j].green; break;
-                    case 2: value = (*img).pixels[i][j].blue; break;
-                }
-                
-                /* fwrite is used instead of fprintf because it can specify the data type and size 
-                 * (fprintf would use short unsigned int, which in some machines may not be 16-bits)*/
-                if(fwrite(&value, sizeof(uint16_t), 1, f) != 1 ){
-                    return false;
-                }
+        free_image(job->out);
+        job->out = NULL;
 
-            }
+    }
 
-    return true;
+    return 0;
 }
 
-/* Allocate a new struct Image and copy an existing struct Image's contents
- * into it. On error, returns NULL. 
- * This function has similar functionality to save_image, but it rather copies 
- * Image content to another Image struct instead of file. */
-struct Image *copy_image(const struct Image *source)
+/* Process the jobs of b as the options ask: streamed, pipelined, with
+ * asynchronous I/O or one stage at a time. Returns the exit status. */
+int process_batch(struct Batch *b)
 {
-    if(source == NULL || source->pixels == NULL){
-        return NULL;
-    }
-    
-    /* Allocate space for new Image struct */
-    struct Image *img_copy = malloc(sizeof *img_copy);
-    if (img_copy == NULL) {
-        return NULL; // Memory allocation failed
+    if (streaming) {
+        for (int i = 0; i < b->count; i++)
+            if (!stream_image(&b->jobs[i]))
+                return 1;
+        return 0;
     }
-    /* Copy width, height and pixel data to Image struct */
+    if (pipelined)
+        return process_pipelined(b);
+    if (async_depth > 0)
+        return process_async(b);
+    return process_jobs(b);
+}
 
-    img_copy->width = source->width;
-    img_copy->height = source->height;
+/* Running XXH64 hash of a stream of bytes, fed 32-byte stripes to four
+ * accumulators as in the reference implementation, so keys are stable
+ * across runs, machines and versions of this program. */
+struct Hasher {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;                     // Bytes hashed so far
+    uint8_t buf[32];                    // Bytes of the current stripe
+    size_t used;
+};
 
-    /* Allocate memory for the pixel data */
-    img_copy->pixels = makeBitmap(img_copy->height, img_copy->width);
-    if (img_copy->pixels == NULL) {
-        free(img_copy); // Free the Image struct if pixel allocation fails
-        return NULL;
-    }
-    
-    for (int i = 0; i < source->height; i++)
-        for (int j = 0; j < source->width; j++)
-            for (int c = 0; c < 3; c++){
-                switch(c){
-                    case 0: (*img_copy).pixels[i][j].red = (*source).pixels[i][j].red; break;
-                    case 1: (*img_copy).pixels[i][j].green = (*source).pixels[i][j].green; break;
-                    case 2: (*img_copy).pixels[i][j].blue = (*source).pixels[i][j].blue; break;
-                }
-            }
-    
-    return img_copy;
+static inline uint64_t hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
 }
 
-/* Perform your first task.
- * Returns a new struct Image containing equal width and height and pixel bit map converted
- * from colour to monochrome. Each pixel value is converted to the weighted sum of the red, 
- * green and blue components: 0.299R + 0.587G + 0.114B. On error returns NULL. */
-struct Image *apply_MONO(const struct Image *source)
+/* Little-endian 64 and 32-bit words at p */
+static inline uint64_t hash_load64(const uint8_t *p)
 {
-    if(source == NULL || source->pixels == NULL){
-        return NULL;
-    }
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
 
-    struct Image *mono_image = copy_image(source);
+static inline uint32_t hash_load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
 
-    /* Iterate through pixel data and set all colors in each pixel to the calculated grey value */
-    for (int i = 0; i < source->height; i++)
-        for (int j = 0; j < source->width; j++){
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    return hash_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
 
-            // Caluclate the weighted sum of the RGB components
-            float greyValue = 0.299 * (*source).pixels[i][j].red + 0.587 * (*source).pixels[i][j].green + 0.114 * (*source).pixels[i][j].blue;
+static inline void hash_stripe(struct Hasher *h, const uint8_t *p)
+{
+    for (int k = 0; k < 4; k++)
+        h->v[k] = hash_round(h->v[k], hash_load64(p + 8 * k));
+}
 
-            // Convert the floating-point grey value to an integer
-            uint16_t grey = (uint16_t)greyValue;
+void hash_init(struct Hasher *h, uint64_t seed)
+{
+    h->v[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    h->v[1] = seed + XXH_PRIME2;
+    h->v[2] = seed;
+    h->v[3] = seed - XXH_PRIME1;
+    h->seed = seed;
+    h->total = 0;
+    h->used = 0;
+}
 
-            // Set each RGB component to the grey value
-            (*mono_image).pixels[i][j].red = (*mono_image).pixels[i][j].green = (*mono_image).pixels[i][j].blue = grey;
+/* Add len bytes at data to h */
+void hash_update(struct Hasher *h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    h->total += len;
+    if (h->used + len < sizeof(h->buf)) {
+        memcpy(h->buf + h->used, p, len);
+        h->used += len;
+        return;
+    }
+    if (h->used > 0) {
+        size_t fill = sizeof(h->buf) - h->used;
+        memcpy(h->buf + h->used, p, fill);
+        hash_stripe(h, h->buf);
+        p += fill;
+        len -= fill;
+        h->used = 0;
+    }
+    for (; len >= sizeof(h->buf); p += sizeof(h->buf), len -= sizeof(h->buf))
+        hash_stripe(h, p);
+    memcpy(h->buf, p, len);
+    h->used = len;
+}
 
-        }
-    
-    return mono_image;
+void hash_int(struct Hasher *h, int value)
+{
+    hash_update(h, &value, sizeof value);
 }
 
-/* Transform 16-bit integers into 8-bit representation to fit RGB range of 0-255 */
-uint8_t eightBits(uint16_t color){
+/* The hash of the bytes added to h */
+uint64_t hash_digest(const struct Hasher *h)
+{
+    uint64_t acc;
+    if (h->total >= sizeof(h->buf)) {
+        acc = hash_rotl(h->v[0], 1) + hash_rotl(h->v[1], 7) + hash_rotl(h->v[2], 12) + hash_rotl(h->v[3], 18);
+        for (int k = 0; k < 4; k++)
+            acc = (acc ^ hash_round(0, h->v[k])) * XXH_PRIME1 + XXH_PRIME4;
+    } else {
+        acc = h->seed + XXH_PRIME5;
+    }
+    acc += h->total;
 
-    uint8_t reduced = (uint8_t)((color * 255) / 65535);
-    return reduced;
+    const uint8_t *p = h->buf;
+    size_t n = h->used;
+    for (; n >= 8; p += 8, n -= 8)
+        acc = hash_rotl(acc ^ hash_round(0, hash_load64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (n >= 4) {
+        acc = hash_rotl(acc ^ hash_load32(p) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--)
+        acc = hash_rotl(acc ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
 
+    acc ^= acc >> 33;
+    acc *= XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= XXH_PRIME3;
+    acc ^= acc >> 32;
+    return acc;
 }
 
-/* Perform your second task.
- * Function accepts an Image struct, printing it's dimensions and pixel data as C source code.
- * Returns false on error. */
-bool apply_CODE(const struct Image *source)
+/* Hash of every setting that changes the output file or CODE text of an
+ * input: the compiled --ops chain (so spellings of the same chain agree),
+ * the --filter kernel and the rest. Threads, SIMD level, layouts and I/O
+ * paths give identical output and are left out. */
+uint64_t cache_settings(void)
+{
+    struct Hasher h;
+    hash_init(&h, 0);
+    hash_update(&h, "HSC1", 4);
+    hash_int(&h, op_chain.count);
+    for (int k = 0; k < op_chain.count; k++) {
+        const struct OpStep *step = &op_chain.steps[k];
+        hash_int(&h, step->gray);
+        hash_update(&h, step->order, sizeof(step->order));
+        hash_int(&h, step->lut != NULL);
+        if (step->lut != NULL)
+            hash_update(&h, step->lut, HIST_BINS * sizeof(uint16_t));
+    }
+    hash_int(&h, image_filter.radius);
+    hash_update(&h, image_filter.weights, (2 * image_filter.radius + 1) * sizeof(int16_t));
+    hash_int(&h, image_filter.amount);
+    hash_int(&h, resize_width);
+    hash_int(&h, resize_height);
+    hash_int(&h, resize_method);
+    hash_int(&h, region.x);
+    hash_int(&h, region.y);
+    hash_int(&h, region.width);
+    hash_int(&h, region.height);
+    hash_int(&h, input_order);
+    hash_int(&h, code_reduce);
+    hash_int(&h, compress_output);
+    hash_int(&h, tile_width);
+    hash_int(&h, tile_height);
+    hash_int(&h, pyramid_levels);
+    return hash_digest(&h);
+}
+
+/* Hash the whole of file filename, seeded with seed, into *key. Returns
+ * false, quietly, when it cannot be read: the usual loading reports it. */
+bool hash_file(const char *filename, uint64_t seed, uint64_t *key)
 {
-    if(source == NULL || source->pixels == NULL){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    uint8_t *buf = malloc(CACHE_CHUNK);
+    if (buf == NULL) {
+        close(fd);
         return false;
     }
+    counters.allocations++;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-    fprintf(stdout, "const int image_width = %d;\n", source->width);
-    fprintf(stdout, "const int image_height = %d;\n", source->height);
-    fprintf(stdout, "const struct Pixel image_data[%d][%d] = {\n", source->height, source->width);
+    struct Hasher h;
+    hash_init(&h, seed);
+    ssize_t n;
+    while ((n = read(fd, buf, CACHE_CHUNK)) > 0) {
+        hash_update(&h, buf, (size_t)n);
+        counters.bytes_read += (uint64_t)n;
+    }
+    free(buf);
+    close(fd);
+    *key = hash_digest(&h);
+    return n == 0;
+}
 
-    /* Each line starts with whitespace to represent indentation */
-    char line[70] = "    ";
+/* Write the name of the file with extension ext of the cache entry of job
+ * to name, MAX_FILENAME + 1 bytes: the entry's output is .img, its pyramid
+ * levels .L1.img, .L2.img and so on, its CODE text .code and statistics
+ * .stats. With temp, the name is that of a temporary file for it instead,
+ * private to this process and job, so that several runs can share the
+ * cache. Returns false when the name is too long. */
+bool cache_name(const struct Job *job, const char *ext, bool temp, char *name)
+{
+    int n = temp ? snprintf(name, MAX_FILENAME + 1, "%s/%016llx%s.%ld-%ld.tmp", cache_dir, (unsigned long long)job->key,
+                            ext, (long)getpid(), (long)(job - batch.jobs))
+                 : snprintf(name, MAX_FILENAME + 1, "%s/%016llx%s", cache_dir, (unsigned long long)job->key, ext);
+    return n > 0 && n <= MAX_FILENAME;
+}
 
-    for (int i = 0; i < source->height; i++) {
+/* Copy file from to file to, replacing its contents. copy_file_range lets
+ * the kernel copy without passing the data through this process, sharing
+ * the blocks outright on filesystems that can; where it is unavailable,
+ * the file is copied a chunk at a time. Returns false on error. */
+bool copy_file(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return false;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
 
-        for (int j = 0; j < source->width; j++) {
-            // Allocate pixel data to local struct Pixel for quick access
-            struct Pixel p = source->pixels[i][j];
+    bool ok = true;
+    uint64_t copied = 0;
+#ifdef SYS_copy_file_range
+    ssize_t n;
+    while ((n = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)AIO_OP_MAX, 0)) > 0)
+        copied += (uint64_t)n;
+    if (n < 0 && (copied > 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)))
+        ok = false;
+    bool fallback = n < 0 && ok;
+#else
+    bool fallback = true;
+#endif
+    if (fallback) {
+        uint8_t *buf = malloc(CACHE_CHUNK);
+        ok = buf != NULL;
+        ssize_t got = 0;
+        while (ok && (got = read(in, buf, CACHE_CHUNK)) > 0) {
+            struct iovec iov = {buf, (size_t)got};
+            ok = writev_all(out, &iov, 1);
+            copied += (uint64_t)got;
+        }
+        ok = ok && got == 0;
+        free(buf);
+        counters.allocations++;
+    }
+    counters.bytes_read += copied;
+    counters.bytes_written += copied;
 
-            // Allocate pixel data to string, containing initial space and comma at the end
-            char pix[18];
-            // Add values to string in curly brackets and a comma
-            snprintf(pix, sizeof(pix), "{%d, %d, %d}, ", eightBits(p.red), eightBits(p.green), eightBits(p.blue));
+    if (ok && fsync_on_close)
+        ok = fsync(out) == 0;
+    if (close(out) != 0)
+        ok = false;
+    close(in);
+    return ok;
+}
 
-            // Check if adding pix to line would exceed maximum line size 
-            if(strlen(line) + strlen(pix) > sizeof(line) - 1){
-                fprintf(stdout, "%s\n", line);
-                strcpy(line, "    "); // Reset line with indentation
-            }
-            strcat(line, pix); // Append pix to line
+struct CacheLookup {
+    struct Batch *batch;
+    uint64_t seed;                      // cache_settings()
+};
 
+/* parallel_rows band: hash the inputs of jobs [row0, row1) and look up
+ * their entries. An entry is complete once its CODE text is in place, as
+ * that is stored last, but is only a hit while its output is there too and,
+ * with --stats, the statistics of the input. */
+void cache_lookup_band(void *ctx, int row0, int row1)
+{
+    const struct CacheLookup *cl = ctx;
+    for (int i = row0; i < row1; i++) {
+        struct Job *job = &cl->batch->jobs[i];
+        struct StageProbe probe;
+        stage_begin(&probe);
+        char name[MAX_FILENAME + 1];
+        if (!hash_file(job->input, cl->seed, &job->key) || !cache_name(job, ".code", false, name)) {
+            stage_end(&probe, job, STAGE_LOAD);
+            continue;
         }
+        job->cache = access(name, R_OK) == 0 ? CACHE_HIT : CACHE_MISS;
+        if (job->cache == CACHE_HIT && (!cache_name(job, ".img", false, name) || access(name, R_OK) != 0))
+            job->cache = CACHE_MISS;
+        if (job->cache == CACHE_HIT && stats_format != METRICS_OFF) {
+            FILE *f = cache_name(job, ".stats", false, name) ? fopen(name, "rb") : NULL;
+            if (f == NULL || fread(job->stats, sizeof(job->stats), 1, f) != 1)
+                job->cache = CACHE_MISS;
+            if (f != NULL)
+                fclose(f);
+        }
+        stage_end(&probe, job, STAGE_LOAD);
     }
-
-    line[strlen(line)-2] = '\0';    // Remove comma from last array value
-    fprintf(stdout, "%s\n", line);
-    fprintf(stdout, "};\n");
-    return true;
 }
 
-/* Allocate new Image struct to linked list */
-void push(struct Image **list, struct Image *img)
+/* Produce the results of job, a cache hit, from its entry: copy the output
+ * file and its pyramid levels into place and print the CODE text. On error,
+ * prints a message and returns false. */
+bool cache_replay(struct Job *job)
 {
-    if (*list == NULL) {
-        *list = img;
-        return;
+    struct StageProbe probe;
+    stage_begin(&probe);
+    char entry[MAX_FILENAME + 1], code[MAX_FILENAME + 1];
+    cache_name(job, ".img", false, entry);
+    cache_name(job, ".code", false, code);
+    FILE *f = fopen(code, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to read cached output %s.\n", code);
+        stage_end(&probe, job, STAGE_CODE);
+        return false;
     }
+    char buf[CODE_BUFFER];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        fwrite(buf, 1, n, stdout);
+        counters.bytes_read += n;
+        counters.bytes_written += n;
+    }
+    fclose(f);
+    stage_end(&probe, job, STAGE_CODE);
+    printf("\n");   // line between images code
 
-    struct Image *f = *list;
-    while (f->next != NULL) {
-        f = f->next; 
+    stage_begin(&probe);
+    bool ok = copy_file(entry, job->output);
+    if (!ok)
+        fprintf(stderr, "Saving image to %s failed.\n", job->output);
+
+    /* The entry has as many levels as were saved for the output */
+    for (int k = 1; ok && k <= PYRAMID_MAX; k++) {
+        char ext[24], from[MAX_FILENAME + 1], to[MAX_FILENAME + 1];
+        snprintf(ext, sizeof(ext), ".L%d.img", k);
+        if (!cache_name(job, ext, false, from) || access(from, R_OK) != 0)
+            break;
+        if (!pyramid_name(job->output, k, to)) {
+            fprintf(stderr, "File name %s is too long for its pyramid levels.\n", job->output);
+            ok = false;
+        } else if (!copy_file(from, to)) {
+            fprintf(stderr, "Saving image to %s failed.\n", to);
+            ok = false;
+        }
     }
-    f->next = img; 
+    stage_end(&probe, job, STAGE_SAVE);
+    return ok;
 }
 
-
-int main(int argc, char *argv[])
+/* Copy file from into the cache entry of job as its file with extension
+ * ext, through a temporary file so that no reader ever sees it half
+ * written. Returns false on error. */
+bool cache_put(const struct Job *job, const char *from, const char *ext)
 {
-
-    /* Check command-line arguments (exclusing the program name arguments should be even. 
-     * For every input file there should be an output file) */
-    if (argc < 3 || (argc - 1) % 2 != 0) {
-        fprintf(stderr, "Usage: process INPUTFILE₁...INPUTFILEn OUTPUTFILE₁...OUTPUTFILEn\n");
-        return 1;
+    char name[MAX_FILENAME + 1], temp[MAX_FILENAME + 1];
+    if (!cache_name(job, ext, false, name) || !cache_name(job, ext, true, temp))
+        return false;
+    if (!copy_file(from, temp) || rename(temp, name) != 0) {
+        unlink(temp);
+        return false;
     }
+    return true;
+}
 
-    /* Load input images to linked list */
-    for (int i = 0; i < (argc -1)/2; i++){
+/* Store the results of job, a cache miss that has just been processed
+ * successfully when ok is set: its output file, pyramid levels and
+ * statistics, then its CODE text, which completes the entry. A failed
+ * store only leaves the entry missing. */
+void cache_store(struct Job *job, bool ok)
+{
+    char code[MAX_FILENAME + 1], temp[MAX_FILENAME + 1];
+    cache_name(job, ".code", false, code);
+    cache_name(job, ".code", true, temp);
+    if (job->code_copy != NULL && fclose(job->code_copy) != 0)
+        ok = false;
+    job->code_copy = NULL;
 
-        /* Load the input image */
-        struct Image *in_img = load_image(argv[i+1]);
-        if(in_img == NULL)
-            return 1;
-        push(&fip, in_img);
+    /* The entry holds as many levels as were saved for the output */
+    struct Header h;
+    FILE *out = ok ? fopen(job->output, "r") : NULL;
+    ok = out != NULL && read_header(out, job->output, &h);
+    if (out != NULL)
+        fclose(out);
 
+    struct StageProbe probe;
+    stage_begin(&probe);
+    ok = ok && cache_put(job, job->output, ".img");
+    int levels = ok ? pyramid_depth(h.width, h.height) : 0;
+    for (int k = 1; ok && k <= levels; k++) {
+        char ext[24], from[MAX_FILENAME + 1];
+        snprintf(ext, sizeof(ext), ".L%d.img", k);
+        ok = pyramid_name(job->output, k, from) && cache_put(job, from, ext);
     }
-    
-    /* Apply the first process and load images to output linked list */
+    if (ok && stats_format != METRICS_OFF) {
+        char stats[MAX_FILENAME + 1], stats_temp[MAX_FILENAME + 1];
+        ok = cache_name(job, ".stats", false, stats) && cache_name(job, ".stats", true, stats_temp);
+        FILE *f = ok ? fopen(stats_temp, "wb") : NULL;
+        ok = f != NULL && fwrite(job->stats, sizeof(job->stats), 1, f) == 1;
+        if (f != NULL && fclose(f) != 0)
+            ok = false;
+        if (ok)
+            ok = rename(stats_temp, stats) == 0;
+        else
+            unlink(stats_temp);
+    }
+    if (ok)
+        ok = rename(temp, code) == 0;
+    if (!ok)
+        unlink(temp);
+    stage_end(&probe, job, STAGE_SAVE);
+}
 
-    struct Image *img = fip;
-    for (int i = 0; i < (argc - 1) / 2; i++){
+/* Process the jobs of b through the result cache in cache_dir (--cache).
+ * Every input is hashed with the settings, on the thread pool, to name its
+ * entry. Hits are copied from the cache in order, while the misses between
+ * them go through process_batch as usual, up to CACHE_RUN at a time, with
+ * their CODE text collected on the side so that they can be stored once
+ * they have all been saved. Returns the exit status. */
+int process_cached(struct Batch *b)
+{
+    struct stat st;
+    if ((mkdir(cache_dir, 0777) != 0 && errno != EEXIST) || stat(cache_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Unable to create cache directory %s.\n", cache_dir);
+        return 1;
+    }
+    struct CacheLookup cl = {b, cache_settings()};
+    parallel_rows(b->count, cache_lookup_band, &cl);
 
-        struct Image *out_img = apply_MONO(img);
-        if (out_img == NULL) {
-            fprintf(stderr, "First process failed for file %s.\n", argv[i+1]);
-            free_list(fip);
-            return 1;
+    for (int i = 0; i < b->count;) {
+        if (b->jobs[i].cache == CACHE_HIT) {
+            if (!cache_replay(&b->jobs[i]))
+                return 1;
+            i++;
+            continue;
         }
-        push(&fop, out_img);
-        img = img->next;
 
+        int n = 0;
+        while (i + n < b->count && n < CACHE_RUN && b->jobs[i + n].cache != CACHE_HIT)
+            n++;
+        struct Batch run = {b->jobs + i, n, n};
+        for (int k = 0; k < n; k++) {
+            char temp[MAX_FILENAME + 1];
+            struct Job *job = &run.jobs[k];
+            if (job->cache == CACHE_MISS && cache_name(job, ".code", true, temp))
+                job->code_copy = fopen(temp, "w");
+        }
+        int status = process_batch(&run);
+        for (int k = 0; k < n; k++)
+            if (run.jobs[k].cache == CACHE_MISS)
+                cache_store(&run.jobs[k], status == 0 && run.jobs[k].code_copy != NULL);
+        if (status != 0)
+            return status;
+        i += n;
     }
+    return 0;
+}
 
-    /* Iterate through output linked list and apply second and third processes */
+/* Print command-line usage to stderr */
+void usage(void)
+{
+    fprintf(stderr, "Usage: process [OPTIONS] INPUTFILE₁...INPUTFILEn OUTPUTFILE₁...OUTPUTFILEn\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --pad-rows    pad bitmap rows to a multiple of %d pixels\n", ROW_ALIGN_PIXELS);
+    fprintf(stderr, "  --no-mmap     always read input pixel data into memory instead of mapping files\n");
+    fprintf(stderr, "  --writev      write output files with writev straight from the bitmap\n");
+    fprintf(stderr, "  --fsync       flush each output file to stable storage before closing it\n");
+    fprintf(stderr, "  --planar      hold images as separate red, green and blue planes\n");
+    fprintf(stderr, "  --threads=N   process each image with N threads (0: one per CPU, default 1)\n");
+    fprintf(stderr, "  --ops=LIST    per-pixel operations applied instead of MONO, in order, in one pass:\n");
+    fprintf(stderr, "                gray, gamma=G, brightness=B, contrast=C, threshold=T, invert,\n");
+    fprintf(stderr, "                clamp=LO:HI, swap=ORDER (e.g. bgr); values are scaled to [0, 1]\n");
+    fprintf(stderr, "  --filter=SPEC separable filter applied after MONO/--ops: box=R, gaussian=SIGMA\n");
+    fprintf(stderr, "                or sharpen=AMOUNT[:SIGMA] (unsharp mask, default sigma 1)\n");
+    fprintf(stderr, "  --resize=WxH[:METHOD]  resample each image to W x H (0 for either keeps the aspect\n");
+    fprintf(stderr, "                ratio) with box, bilinear or lanczos (default)\n");
+    fprintf(stderr, "  --compress    save images as compressed HS1Z (inputs in any format are read)\n");
+    fprintf(stderr, "  --tile[=WxH]  save images as tiled HS1T, tiles compressed with --compress\n");
+    fprintf(stderr, "                (default %dx%d)\n", TILE_SIZE, TILE_SIZE);
+    fprintf(stderr, "  --region=WxH+X+Y  load only this rectangle of each input, clipped to the image\n");
+    fprintf(stderr, "  --pyramid[=N] also save N half-size levels of each output as NAME.L1.EXT, ...\n");
+    fprintf(stderr, "                (default: until a level fits in %dx%d)\n", PYRAMID_MIN, PYRAMID_MIN);
+    fprintf(stderr, "  --no-recycle  free every image buffer instead of reusing it for the next image\n");
+    fprintf(stderr, "  --pipeline    load, convert and save different images concurrently\n");
+    fprintf(stderr, "  --stream      convert each image a chunk of rows at a time in constant memory\n");
+    fprintf(stderr, "  --cache=DIR   reuse the output and CODE text of inputs already processed with the\n");
+    fprintf(stderr, "                same settings, keeping results in DIR\n");
+    fprintf(stderr, "  --async[=N]   keep up to N file reads and writes in flight across the batch\n");
+    fprintf(stderr, "                (default %d)\n", AIO_DEPTH);
+    fprintf(stderr, "  --async-backend=NAME  asynchronous I/O with auto (default), io_uring or threads\n");
+    fprintf(stderr, "  --reduce=MODE 8-bit rounding of CODE output: truncate (default) or nearest\n");
+    fprintf(stderr, "  --simd=LEVEL  kernel instruction set: auto (default), scalar, sse2 or avx2\n");
+    fprintf(stderr, "  --input-order=ORDER  byte order of HS16 input samples: native (default), little or big\n");
+    fprintf(stderr, "  --metrics[=FORMAT]  print time, I/O, allocations and peak RSS per image and stage\n");
+    fprintf(stderr, "                to stderr at exit: text (default) or json\n");
+    fprintf(stderr, "  --stats[=FORMAT]  print per-channel min, max, median, mean, standard deviation and\n");
+    fprintf(stderr, "                clipping of each input to stderr at exit: text (default) or json\n");
+}
 
-    img = fop;
-    for (int i = 0; i < (argc - 1) / 2; i++){
+/* bench.c includes this file for its functions and brings its own main */
+#ifndef PROCESS_NO_MAIN
+int main(int argc, char *argv[])
+{
 
-        /* Apply the second process  */
-        if (!apply_CODE(img)) {
-            fprintf(stderr, "Second process failed for file %s .\n", argv[(argc-1)/2+i+1]);
-            free_list(fip);
-            free_list(fop);
-            return 1;
+    static const struct option long_options[] = {
+        {"pad-rows", no_argument, NULL, 'p'},
+        {"no-mmap", no_argument, NULL, 'M'},
+        {"writev", no_argument, NULL, 'V'},
+        {"fsync", no_argument, NULL, 'S'},
+        {"simd", required_argument, NULL, 'I'},
+        {"input-order", required_argument, NULL, 'E'},
+        {"planar", no_argument, NULL, 'P'},
+        {"threads", required_argument, NULL, 'j'},
+        {"pipeline", no_argument, NULL, 'L'},
+        {"stream", no_argument, NULL, 'T'},
+        {"reduce", required_argument, NULL, 'R'},
+        {"metrics", optional_argument, NULL, 'm'},
+        {"no-recycle", no_argument, NULL, 'C'},
+        {"ops", required_argument, NULL, 'O'},
+        {"filter", required_argument, NULL, 'F'},
+        {"resize", required_argument, NULL, 'Z'},
+        {"stats", optional_argument, NULL, 'H'},
+        {"compress", no_argument, NULL, 'z'},
+        {"tile", optional_argument, NULL, 't'},
+        {"region", required_argument, NULL, 'G'},
+        {"pyramid", optional_argument, NULL, 'Y'},
+        {"cache", required_argument, NULL, 'K'},
+        {"async", optional_argument, NULL, 'A'},
+        {"async-backend", required_argument, NULL, 'B'},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char *ops = "gray";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': pad_rows = true; break;
+            case 'O': ops = optarg; break;
+            case 'F':
+                if (!parse_filter(optarg, &image_filter)) { usage(); return 1; }
+                break;
+            case 'Z':
+                if (!parse_resize(optarg)) { usage(); return 1; }
+                break;
+            case 'M': map_input = false; break;
+            case 'V': write_mode = WRITE_VECTORED; break;
+            case 'S': fsync_on_close = true; break;
+            case 'P': image_layout = LAYOUT_PLANAR; break;
+            case 'C': recycle_images = false; break;
+            case 'z': compress_output = true; break;
+            case 't':
+                if (!parse_tile(optarg)) { usage(); return 1; }
+                break;
+            case 'G':
+                if (!parse_region(optarg)) { usage(); return 1; }
+                break;
+            case 'Y':
+                if (!parse_pyramid(optarg)) { usage(); return 1; }
+                break;
+            case 'L': pipelined = true; break;
+            case 'T': streaming = true; break;
+            case 'K':
+                if (!parse_cache(optarg)) { usage(); return 1; }
+                break;
+            case 'A':
+                if (!parse_async(optarg)) { usage(); return 1; }
+                break;
+            case 'B':
+                if (strcmp(optarg, "auto") == 0) async_backend = AIO_AUTO;
+                else if (strcmp(optarg, "io_uring") == 0) async_backend = AIO_URING;
+                else if (strcmp(optarg, "threads") == 0) async_backend = AIO_THREADS;
+                else { usage(); return 1; }
+                break;
+            case 'E':
+                if (strcmp(optarg, "native") == 0) input_order = ORDER_NATIVE;
+                else if (strcmp(optarg, "little") == 0) input_order = ORDER_LITTLE;
+                else if (strcmp(optarg, "big") == 0) input_order = ORDER_BIG;
+                else { usage(); return 1; }
+                break;
+            case 'R':
+                if (strcmp(optarg, "truncate") == 0) code_reduce = REDUCE_TRUNCATE;
+                else if (strcmp(optarg, "nearest") == 0) code_reduce = REDUCE_NEAREST;
+                else { usage(); return 1; }
+                break;
+            case 'm':
+                if (optarg == NULL || strcmp(optarg, "text") == 0) metrics_format = METRICS_TEXT;
+                else if (strcmp(optarg, "json") == 0) metrics_format = METRICS_JSON;
+                else { usage(); return 1; }
+                break;
+            case 'H':
+                if (optarg == NULL || strcmp(optarg, "text") == 0) stats_format = METRICS_TEXT;
+                else if (strcmp(optarg, "json") == 0) stats_format = METRICS_JSON;
+                else { usage(); return 1; }
+                break;
+            case 'j':
+                thread_count = atoi(optarg);
+                if (thread_count < 0) { usage(); return 1; }
+                break;
+            case 'I':
+                if (strcmp(optarg, "auto") == 0) simd = SIMD_AUTO;
+                else if (strcmp(optarg, "scalar") == 0) simd = SIMD_SCALAR;
+                else if (strcmp(optarg, "sse2") == 0) simd = SIMD_SSE2;
+                else if (strcmp(optarg, "avx2") == 0) simd = SIMD_AVX2;
+                else { usage(); return 1; }
+                break;
+            default: usage(); return 1;
         }
+    }
 
-        printf("\n");   // line between images code
+    if (!parse_ops(ops, &op_chain)) {
+        usage();
+        return 1;
+    }
+    if (streaming && image_filter.radius > 0) {
+        fprintf(stderr, "--filter needs whole images and cannot be used with --stream.\n");
+        return 1;
+    }
+    if (streaming && (tile_width > 0 || region.width > 0)) {
+        fprintf(stderr, "--tile and --region need whole images and cannot be used with --stream.\n");
+        return 1;
+    }
+    if (async_depth > 0 && (streaming || pipelined)) {
+        fprintf(stderr, "--async cannot be used with --stream or --pipeline.\n");
+        return 1;
+    }
 
-        /* Save the output image */
-        if (!save_image(img, argv[(argc-1)/2+i+1])) {
-            fprintf(stderr, "Saving image to %s failed.\n", argv[(argc-1)/2+i+1]);
-            free_list(fip);
-            free_list(fop);
-            return 1;
-        }
+    resolve_simd();
+    if (!create_pool()) {
+        fprintf(stderr, "Unable to start %d threads.\n", thread_count);
+        return 1;
+    }
+    atexit(image_pool_drain);
 
-        img = img->next;
+    /* Only the file names remain, with the program name in argv[0] as before */
+    argv += optind - 1;
+    argc -= optind - 1;
 
+    /* Check command-line arguments (exclusing the program name arguments should be even. 
+     * For every input file there should be an output file) */
+    if (argc < 3 || (argc - 1) % 2 != 0) {
+        usage();
+        return 1;
     }
 
-    free_list(fip);
-    free_list(fop);
-    return 0;
+    /* One job per input/output pair. Registered after image_pool_drain, so
+     * free_batch runs first at exit and the reports before both. */
+    int n = (argc - 1) / 2;
+    for (int i = 0; i < n; i++)
+        if (!batch_add(&batch, argv[i+1], argv[n+i+1])) {
+            fprintf(stderr, "Unable to allocate memory for %d images.\n", n);
+            return 1;
+        }
+    atexit(free_batch);
+    if (stats_format != METRICS_OFF)
+        atexit(report_stats);
+    if (metrics_format != METRICS_OFF)
+        atexit(report_metrics);
+
+    if (cache_dir != NULL)
+        return process_cached(&batch);
+    return process_batch(&batch);
 }
+#endif